@@ -1,15 +1,23 @@
 #include "assert.h"
 #include "inttypes.h" // PRIus64
+#include "math.h" // pow
 #include "stdio.h"
+#include "stdlib.h" // setenv
 #include "string.h" // memset
+#include "unistd.h" // sysconf
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <thread>
 #include <vector>
 
 #define HSA_LARGE_MODEL 1 // has to go before including hsa.h
 
 #include "hsa.h"
+#include "hsa_cpu.h" // extensions of the CPU runtime
 
 std::atomic<int>* counter; // used in the multi-threaded dispatch
 uint64_t KERNEL_OBJECT;
@@ -92,7 +100,7 @@ uint16_t setup = kernel_dispatch_setup();
 __atomic_store_n(packet, hdr | (setup << 16), __ATOMIC_RELEASE);
 }
 
-void hello_world() {
+void hello_world(void* kernarg, const hsa_cpu_workgroup_t* workgroup) {
 	printf("Hello World!\n");
 }
 
@@ -134,7 +142,7 @@ void simple_dispatch() {
     hsa_shut_down();
 }
 
-void increment(void* kernarg) {
+void increment(void* kernarg, const hsa_cpu_workgroup_t* workgroup) {
     std::atomic<int>* counter = (std::atomic<int>*) kernarg;
     counter->fetch_add(1, std::memory_order_release);
 }
@@ -208,6 +216,129 @@ void multithread_dispatch() {
     hsa_shut_down();
 }
 
+// A batch of consecutive packet slots, reserved with a single update of the write index
+typedef struct packet_batch_s {
+    hsa_queue_t* queue;
+    uint64_t first_id;
+    uint32_t count;
+} packet_batch_t;
+
+// Reserve count packet slots, waiting until the queue has room for all of them. Fails if the
+// batch is larger than the queue.
+bool batch_reserve(hsa_queue_t* queue, uint32_t count, packet_batch_t* batch) {
+    if (count == 0 || count > queue->size) {
+        return false;
+    }
+    batch->queue = queue;
+    batch->count = count;
+    batch->first_id = hsa_queue_add_write_index_relaxed(queue, count);
+    // Wait until the last slot of the batch is free
+    while (batch->first_id + count - hsa_queue_load_read_index_scacquire(queue) > queue->size);
+    return true;
+}
+
+// Address of the i-th packet of the batch, considering wrap-around
+hsa_kernel_dispatch_packet_t* batch_packet(const packet_batch_t* batch, uint32_t i) {
+    hsa_kernel_dispatch_packet_t* packets = (hsa_kernel_dispatch_packet_t*)batch->queue->base_address;
+    return packets + (batch->first_id + i) % batch->queue->size;
+}
+
+// Publish all the packets of the batch and ring the doorbell once. Headers are stored from the
+// last packet to the first, so by the time the packet processor sees the first packet as valid
+// the whole batch is, and it can retire all of them in one go.
+void batch_submit(const packet_batch_t* batch, uint16_t header, uint16_t setup) {
+    for (uint32_t i = batch->count; i > 0; i--) {
+        packet_store_release((uint32_t*) batch_packet(batch, i - 1), header, setup);
+    }
+    hsa_signal_store_screlease(batch->queue->doorbell_signal, batch->first_id + batch->count - 1);
+}
+
+void batched_dispatch() {
+    hsa_init();
+    counter = new std::atomic<int>(0);
+    hsa_agent_t kernel_agent;
+    hsa_iterate_agents(get_kernel_agent, &kernel_agent);
+    hsa_queue_t *queue;
+    hsa_queue_create(kernel_agent, 128, HSA_QUEUE_TYPE_SINGLE, NULL, NULL, 0, 0, &queue);
+
+    const uint32_t kNumPackets = 64 * 1024;
+    const uint32_t kBatchSizes[] = {1, 8, 64};
+    for (uint32_t batch_size : kBatchSizes) {
+        hsa_signal_t signal;
+        hsa_signal_create(kNumPackets, 0, NULL, &signal);
+        counter->store(0);
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < kNumPackets; i += batch_size) {
+            packet_batch_t batch;
+            batch_reserve(queue, batch_size, &batch);
+            for (uint32_t j = 0; j < batch_size; j++) {
+                hsa_kernel_dispatch_packet_t* packet = batch_packet(&batch, j);
+                initialize_packet(packet);
+                packet->kernarg_address = counter;
+                packet->completion_signal = signal;
+            }
+            batch_submit(&batch, header(HSA_PACKET_TYPE_KERNEL_DISPATCH), kernel_dispatch_setup());
+        }
+        while (hsa_signal_wait_scacquire(signal, HSA_SIGNAL_CONDITION_EQ, 0, UINT64_MAX, HSA_WAIT_STATE_BLOCKED) != 0);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        assert(counter->load() == (int)kNumPackets);
+        printf("Batch size %2u: %.0f packets/s\n", batch_size, kNumPackets / elapsed.count());
+        hsa_signal_destroy(signal);
+    }
+
+    hsa_queue_destroy(queue);
+    hsa_shut_down();
+}
+
+void increment_kernarg(void* kernarg, const hsa_cpu_workgroup_t* workgroup) {
+    std::atomic<int>* counter = *(std::atomic<int>**) kernarg;
+    counter->fetch_add(1, std::memory_order_release);
+}
+
+// Kernel arguments taken from the kernarg arena of the queue: no allocation on the dispatch path,
+// and nothing to free once the packets are retired.
+void kernarg_arena() {
+    hsa_init();
+    counter = new std::atomic<int>(0);
+    hsa_agent_t kernel_agent;
+    hsa_iterate_agents(get_kernel_agent, &kernel_agent);
+    hsa_queue_t *queue;
+    hsa_queue_create(kernel_agent, 128, HSA_QUEUE_TYPE_SINGLE, NULL, NULL, 0, 0, &queue);
+    hsa_kernel_dispatch_packet_t* packets = (hsa_kernel_dispatch_packet_t*)queue->base_address;
+
+    const uint32_t kNumPackets = 64 * 1024;
+    const size_t kKernargSizes[] = {64, 4096};
+    for (size_t kernarg_size : kKernargSizes) {
+        hsa_signal_t signal;
+        hsa_signal_create(kNumPackets, 0, NULL, &signal);
+        counter->store(0);
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < kNumPackets; i++) {
+            uint64_t packet_id = hsa_queue_add_write_index_relaxed(queue, 1);
+            while (packet_id - hsa_queue_load_read_index_scacquire(queue) >= queue->size);
+            hsa_kernel_dispatch_packet_t* packet = packets + packet_id % queue->size;
+            initialize_packet(packet);
+            hsa_cpu_queue_kernarg_allocate(queue, packet_id, kernarg_size, &packet->kernarg_address);
+            *(std::atomic<int>**) packet->kernarg_address = counter;
+            packet->completion_signal = signal;
+            packet_store_release((uint32_t*) packet, header(HSA_PACKET_TYPE_KERNEL_DISPATCH), kernel_dispatch_setup());
+            hsa_signal_store_screlease(queue->doorbell_signal, packet_id);
+        }
+        while (hsa_signal_wait_scacquire(signal, HSA_SIGNAL_CONDITION_EQ, 0, UINT64_MAX, HSA_WAIT_STATE_BLOCKED) != 0);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        assert(counter->load() == (int)kNumPackets);
+        printf("Kernarg size %4zu: %.0f packets/s\n", kernarg_size, kNumPackets / elapsed.count());
+        hsa_signal_destroy(signal);
+    }
+
+    hsa_queue_destroy(queue);
+    hsa_shut_down();
+}
+
 void callback(hsa_status_t status, hsa_queue_t* queue, void* data) {
   const char* message;
   hsa_status_string(status, &message);
@@ -243,8 +374,8 @@ void error_callback() {
   hsa_shut_down();
 }
 
-void print_signal_value(uint64_t args) {
-  hsa_signal_t signal  = *((hsa_signal_t*) args);
+void print_signal_value(void* kernarg, const hsa_cpu_workgroup_t* workgroup) {
+  hsa_signal_t signal  = *((hsa_signal_t*) kernarg);
   printf("Signal value: %ld\n", hsa_signal_load_scacquire(signal));
 }
 
@@ -314,6 +445,7 @@ int kernarg_usage() {
 
     // Find region that serves as backing storage for the kernarg segment
     populate_kernarg(kernel_agent, packet);
+    void* kernarg = packet->kernarg_address;
 
     // Create a signal with an initial value of one to monitor the task completion
     hsa_signal_t completion_signal;
@@ -329,16 +461,63 @@ int kernarg_usage() {
 
     // Done! The kernel has completed. Time to cleanup resources and leave.
     hsa_signal_destroy(completion_signal);
-    //hsa_signal_destroy(signal);
+    hsa_signal_destroy(*(hsa_signal_t*) kernarg);
+    hsa_memory_free(kernarg);
     hsa_queue_destroy(queue);
     hsa_shut_down();
     return 0;
 }
 
-void KERNEL_OBJECT_A() {
+void churn(hsa_region_t region, uint32_t pairs) {
+    for (uint32_t i = 0; i < pairs; i++) {
+        void* ptr;
+        hsa_memory_allocate(region, 16 + i % 1024, &ptr);
+        hsa_memory_free(ptr);
+    }
+}
+
+// Same pattern against the C library allocator, for comparison
+void churn_malloc(uint32_t pairs) {
+    for (uint32_t i = 0; i < pairs; i++) {
+        // volatile, or the compiler drops the pair altogether
+        void* volatile ptr = malloc(16 + i % 1024);
+        free(ptr);
+    }
+}
+
+// Allocate/free pairs from many threads. Every block goes back to its region, so the footprint of
+// the process stays flat no matter how long this runs.
+void memory_churn() {
+    hsa_init();
+    hsa_agent_t kernel_agent;
+    hsa_iterate_agents(get_kernel_agent, &kernel_agent);
+    hsa_region_t region;
+    hsa_agent_iterate_regions(kernel_agent, get_kernarg, &region);
+
+    const int kNumThreads = 16;
+    const uint32_t kNumPairs = 10 * 1000 * 1000;
+    for (int use_malloc = 0; use_malloc < 2; use_malloc++) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::vector<std::thread*> threads;
+        for (int i = 0; i < kNumThreads; i++) {
+            threads.push_back(use_malloc ? new std::thread(churn_malloc, kNumPairs / kNumThreads)
+                                         : new std::thread(churn, region, kNumPairs / kNumThreads));
+        }
+        for (unsigned int i = 0; i < threads.size(); i++) {
+            threads.at(i)->join();
+            delete threads.at(i);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        printf("%s: %.0f allocate/free pairs/s\n", use_malloc ? "malloc/free" : "hsa_memory_allocate/free", kNumPairs / elapsed.count());
+    }
+
+    hsa_shut_down();
+}
+
+void KERNEL_OBJECT_A(void* kernarg, const hsa_cpu_workgroup_t* workgroup) {
     printf("Kernel agent A\n");
 }
-void KERNEL_OBJECT_B() {
+void KERNEL_OBJECT_B(void* kernarg, const hsa_cpu_workgroup_t* workgroup) {
     printf("Kernel agent B\n");
 }
 
@@ -359,6 +538,1158 @@ hsa_agent_t* get_kernel_agents() {
     return &(kernel_agents->at(0));
 }
 
+// Number of kernel agents, for the examples that need more than one
+size_t count_kernel_agents() {
+    hsa_init();
+    std::vector<hsa_agent_t> kernel_agents;
+    hsa_iterate_agents(accumulate_kernel_agents, (void*) &kernel_agents);
+    hsa_shut_down();
+    return kernel_agents.size();
+}
+
+typedef struct read_args_s {
+    const uint64_t* buffer;
+    size_t chunk_words;
+    uint64_t* sums;
+} read_args_t;
+
+// Every workgroup sums one chunk of the buffer
+void read_chunk(void* kernarg, const hsa_cpu_workgroup_t* workgroup) {
+    const read_args_t* args = (const read_args_t*) kernarg;
+    const uint64_t* chunk = args->buffer + workgroup->id[0] * args->chunk_words;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < args->chunk_words; i++) {
+        sum += chunk[i];
+    }
+    args->sums[workgroup->id[0]] = sum;
+}
+
+hsa_status_t collect_regions(hsa_region_t region, void* data) {
+    hsa_region_segment_t segment;
+    hsa_region_get_info(region, HSA_REGION_INFO_SEGMENT, &segment);
+    bool alloc_allowed = false;
+    hsa_region_get_info(region, HSA_REGION_INFO_RUNTIME_ALLOC_ALLOWED, &alloc_allowed);
+    if (segment == HSA_REGION_SEGMENT_GLOBAL && alloc_allowed) {
+        ((std::vector<hsa_region_t>*) data)->push_back(region);
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+// Read bandwidth of every (kernel agent, region) pair. Regions are listed local first, so the
+// first lines of each agent are the bandwidth it gets from its own memory node.
+void region_bandwidth() {
+    hsa_init();
+    std::vector<hsa_agent_t> agents;
+    hsa_iterate_agents(accumulate_kernel_agents, &agents);
+
+    const uint32_t kNumChunks = 64;
+    const size_t kChunkWords = 128 * 1024;
+    const size_t kBufferSize = kNumChunks * kChunkWords * sizeof(uint64_t);
+    const int kNumPasses = 8;
+    for (hsa_agent_t agent : agents) {
+        uint32_t node = 0;
+        hsa_agent_get_info(agent, HSA_AGENT_INFO_NODE, &node);
+        std::vector<hsa_region_t> regions;
+        hsa_agent_iterate_regions(agent, collect_regions, &regions);
+        hsa_queue_t* queue;
+        hsa_queue_create(agent, 16, HSA_QUEUE_TYPE_SINGLE, NULL, NULL, 0, 0, &queue);
+        hsa_kernel_dispatch_packet_t* packets = (hsa_kernel_dispatch_packet_t*) queue->base_address;
+
+        for (size_t r = 0; r < regions.size(); r++) {
+            uint64_t* buffer;
+            uint64_t* sums;
+            if (hsa_memory_allocate(regions[r], kBufferSize, (void**) &buffer) != HSA_STATUS_SUCCESS ||
+                hsa_memory_allocate(regions[r], kNumChunks * sizeof(uint64_t), (void**) &sums) != HSA_STATUS_SUCCESS) {
+                continue;
+            }
+            hsa_memory_assign_agent(buffer, agent, HSA_ACCESS_PERMISSION_RW);
+            hsa_memory_assign_agent(sums, agent, HSA_ACCESS_PERMISSION_RW);
+            for (size_t i = 0; i < kNumChunks * kChunkWords; i++) {
+                buffer[i] = i;
+            }
+
+            hsa_signal_t signal;
+            hsa_signal_create(kNumPasses, 0, NULL, &signal);
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (int pass = 0; pass < kNumPasses; pass++) {
+                uint64_t packet_id = hsa_queue_add_write_index_relaxed(queue, 1);
+                while (packet_id - hsa_queue_load_read_index_scacquire(queue) >= queue->size);
+                hsa_kernel_dispatch_packet_t* packet = packets + packet_id % queue->size;
+                initialize_packet(packet);
+                packet->workgroup_size_x = 1;
+                packet->grid_size_x = kNumChunks;
+                hsa_cpu_queue_kernarg_allocate(queue, packet_id, sizeof(read_args_t), &packet->kernarg_address);
+                read_args_t* args = (read_args_t*) packet->kernarg_address;
+                args->buffer = buffer;
+                args->chunk_words = kChunkWords;
+                args->sums = sums;
+                packet->completion_signal = signal;
+                packet_store_release((uint32_t*) packet, header(HSA_PACKET_TYPE_KERNEL_DISPATCH), kernel_dispatch_setup());
+                hsa_signal_store_screlease(queue->doorbell_signal, packet_id);
+            }
+            while (hsa_signal_wait_scacquire(signal, HSA_SIGNAL_CONDITION_EQ, 0, UINT64_MAX, HSA_WAIT_STATE_BLOCKED) != 0);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+            uint64_t total = 0;
+            for (uint32_t i = 0; i < kNumChunks; i++) {
+                total += sums[i];
+            }
+            uint64_t words = kNumChunks * kChunkWords;
+            assert(total == words * (words - 1) / 2);
+            uint32_t flags = 0;
+            hsa_region_get_info(regions[r], HSA_REGION_INFO_GLOBAL_FLAGS, &flags);
+            printf("Agent on node %u, region %zu (%s): %.2f GB/s\n", node, r,
+                   (flags & HSA_REGION_GLOBAL_FLAG_COARSE_GRAINED) ? "coarse-grained" : "fine-grained",
+                   kNumPasses * kBufferSize / elapsed.count() / 1e9);
+            hsa_signal_destroy(signal);
+            hsa_memory_free(sums);
+            hsa_memory_free(buffer);
+        }
+        hsa_queue_destroy(queue);
+    }
+
+    hsa_shut_down();
+}
+
+typedef struct random_args_s {
+    const uint64_t* buffer;
+    size_t words;
+    uint32_t reads;
+    uint64_t* sums;
+} random_args_t;
+
+// Every workgroup reads random words of the buffer
+void read_random(void* kernarg, const hsa_cpu_workgroup_t* workgroup) {
+    const random_args_t* args = (const random_args_t*) kernarg;
+    uint64_t state = 0x9E3779B97F4A7C15ull * (workgroup->id[0] + 1);
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < args->reads; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        sum += args->buffer[state % args->words];
+    }
+    args->sums[workgroup->id[0]] = sum;
+}
+
+hsa_status_t get_region_by_flag(hsa_region_t region, void* data) {
+    hsa_region_t* ret = (hsa_region_t*) data;
+    hsa_region_segment_t segment;
+    hsa_region_get_info(region, HSA_REGION_INFO_SEGMENT, &segment);
+    uint32_t flags = 0;
+    hsa_region_get_info(region, HSA_REGION_INFO_GLOBAL_FLAGS, &flags);
+    // the wanted flag comes in through the handle
+    if (segment == HSA_REGION_SEGMENT_GLOBAL && (flags & ret->handle)) {
+        *ret = region;
+        return HSA_STATUS_INFO_BREAK;
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+// Random reads over a working set much larger than the TLB reach of 4 KiB pages: the
+// fine-grained region backs it with regular pages, the coarse-grained one with 2 MiB pages.
+void random_access() {
+    hsa_init();
+    hsa_agent_t kernel_agent;
+    hsa_iterate_agents(get_kernel_agent, &kernel_agent);
+    hsa_queue_t* queue;
+    hsa_queue_create(kernel_agent, 16, HSA_QUEUE_TYPE_SINGLE, NULL, NULL, 0, 0, &queue);
+    hsa_kernel_dispatch_packet_t* packets = (hsa_kernel_dispatch_packet_t*) queue->base_address;
+
+    const size_t kBufferSize = 256 * 1024 * 1024;
+    const uint32_t kNumWorkgroups = 4;
+    const uint32_t kReads = 4 * 1024 * 1024;
+    const uint32_t kFlags[] = {HSA_REGION_GLOBAL_FLAG_FINE_GRAINED, HSA_REGION_GLOBAL_FLAG_COARSE_GRAINED};
+    for (uint32_t flag : kFlags) {
+        hsa_region_t region;
+        region.handle = flag;
+        hsa_agent_iterate_regions(kernel_agent, get_region_by_flag, &region);
+        size_t granule = 0;
+        hsa_region_get_info(region, HSA_REGION_INFO_RUNTIME_ALLOC_GRANULE, &granule);
+
+        uint64_t* buffer;
+        uint64_t* sums;
+        hsa_memory_allocate(region, kBufferSize, (void**) &buffer);
+        // coarse-grained memory is only visible to its owner
+        hsa_memory_assign_agent(buffer, kernel_agent, HSA_ACCESS_PERMISSION_RW);
+        hsa_memory_allocate(region, kNumWorkgroups * sizeof(uint64_t), (void**) &sums);
+        hsa_memory_assign_agent(sums, kernel_agent, HSA_ACCESS_PERMISSION_RW);
+        memset(buffer, 1, kBufferSize);
+
+        hsa_signal_t signal;
+        hsa_signal_create(1, 0, NULL, &signal);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        uint64_t packet_id = hsa_queue_add_write_index_relaxed(queue, 1);
+        hsa_kernel_dispatch_packet_t* packet = packets + packet_id % queue->size;
+        initialize_packet(packet);
+        packet->workgroup_size_x = 1;
+        packet->grid_size_x = kNumWorkgroups;
+        hsa_cpu_queue_kernarg_allocate(queue, packet_id, sizeof(random_args_t), &packet->kernarg_address);
+        random_args_t* args = (random_args_t*) packet->kernarg_address;
+        args->buffer = buffer;
+        args->words = kBufferSize / sizeof(uint64_t);
+        args->reads = kReads;
+        args->sums = sums;
+        packet->completion_signal = signal;
+        packet_store_release((uint32_t*) packet, header(HSA_PACKET_TYPE_KERNEL_DISPATCH), kernel_dispatch_setup());
+        hsa_signal_store_screlease(queue->doorbell_signal, packet_id);
+        while (hsa_signal_wait_scacquire(signal, HSA_SIGNAL_CONDITION_EQ, 0, UINT64_MAX, HSA_WAIT_STATE_BLOCKED) != 0);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        for (uint32_t i = 0; i < kNumWorkgroups; i++) {
+            assert(sums[i] == kReads * 0x0101010101010101ull);
+        }
+        printf("%s region (granule %zu): %.1f M reads/s\n", flag == HSA_REGION_GLOBAL_FLAG_FINE_GRAINED ? "Fine-grained" : "Coarse-grained",
+               granule, kNumWorkgroups * kReads / elapsed.count() / 1e6);
+        hsa_signal_destroy(signal);
+        hsa_memory_free(sums);
+        hsa_memory_free(buffer);
+    }
+
+    hsa_queue_destroy(queue);
+    hsa_shut_down();
+}
+
+// hsa_memory_copy against memcpy, from 64 bytes to 1 GiB. Every size is copied repeatedly
+// until about 1 GiB has moved.
+void copy_bandwidth() {
+    hsa_init();
+    hsa_agent_t kernel_agent;
+    hsa_iterate_agents(get_kernel_agent, &kernel_agent);
+    hsa_region_t region;
+    region.handle = HSA_REGION_GLOBAL_FLAG_COARSE_GRAINED;
+    hsa_agent_iterate_regions(kernel_agent, get_region_by_flag, &region);
+
+    const size_t kMaxSize = 1024 * 1024 * 1024;
+    uint8_t* src;
+    uint8_t* dst;
+    hsa_memory_allocate(region, kMaxSize, (void**) &src);
+    hsa_memory_allocate(region, kMaxSize, (void**) &dst);
+    memset(src, 1, kMaxSize);
+    memset(dst, 0, kMaxSize);
+
+    printf("%12s %16s %16s\n", "size", "hsa_memory_copy", "memcpy");
+    for (size_t size = 64; size <= kMaxSize; size *= 4) {
+        size_t iterations = kMaxSize / size;
+        double bandwidth[2];
+        for (int use_memcpy = 0; use_memcpy < 2; use_memcpy++) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < iterations; i++) {
+                if (use_memcpy) {
+                    memcpy(dst, src, size);
+                } else {
+                    hsa_memory_copy(dst, src, size);
+                }
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            bandwidth[use_memcpy] = iterations * size / elapsed.count() / 1e9;
+        }
+        assert(dst[size - 1] == 1);
+        printf("%12zu %11.2f GB/s %11.2f GB/s\n", size, bandwidth[0], bandwidth[1]);
+    }
+
+    hsa_memory_free(dst);
+    hsa_memory_free(src);
+    hsa_shut_down();
+}
+
+// Stages a buffer into kernel memory chunk by chunk and sums every chunk with a kernel. Serialized,
+// each chunk is copied and then processed; pipelined, all the copies go to the async copy engine
+// up front and a barrier-AND packet holds each kernel only until its own chunk has arrived, so
+// copying the next chunk overlaps with processing the current one.
+void copy_compute_overlap() {
+    hsa_init();
+    hsa_agent_t kernel_agent;
+    hsa_iterate_agents(get_kernel_agent, &kernel_agent);
+    hsa_region_t region;
+    hsa_agent_iterate_regions(kernel_agent, get_kernarg, &region);
+    hsa_queue_t* queue;
+    hsa_queue_create(kernel_agent, 64, HSA_QUEUE_TYPE_SINGLE, NULL, NULL, 0, 0, &queue);
+
+    const uint32_t kNumChunks = 16;
+    const uint32_t kWorkgroupsPerChunk = 8;
+    const size_t kChunkWords = 2 * 1024 * 1024;
+    const size_t kChunkSize = kChunkWords * sizeof(uint64_t);
+    uint64_t* host;
+    uint64_t* device;
+    uint64_t* sums;
+    hsa_memory_allocate(region, kNumChunks * kChunkSize, (void**) &host);
+    hsa_memory_allocate(region, kNumChunks * kChunkSize, (void**) &device);
+    hsa_memory_allocate(region, kNumChunks * kWorkgroupsPerChunk * sizeof(uint64_t), (void**) &sums);
+    for (size_t i = 0; i < kNumChunks * kChunkWords; i++) {
+        host[i] = i;
+    }
+
+    hsa_signal_t copied[kNumChunks];
+    for (uint32_t i = 0; i < kNumChunks; i++) {
+        hsa_signal_create(1, 0, NULL, &copied[i]);
+    }
+
+    for (int pipelined = 0; pipelined < 2; pipelined++) {
+        memset(device, 0, kNumChunks * kChunkSize);
+        hsa_signal_t done;
+        hsa_signal_create(kNumChunks, 0, NULL, &done);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < kNumChunks; i++) {
+            hsa_signal_store_relaxed(copied[i], 1);
+            if (pipelined) {
+                hsa_cpu_memory_async_copy(device + i * kChunkWords, host + i * kChunkWords, kChunkSize, 0, NULL, copied[i]);
+            }
+        }
+        for (uint32_t i = 0; i < kNumChunks; i++) {
+            if (!pipelined) {
+                hsa_memory_copy(device + i * kChunkWords, host + i * kChunkWords, kChunkSize);
+                hsa_signal_store_relaxed(copied[i], 0);
+            }
+            uint64_t packet_id = hsa_queue_add_write_index_relaxed(queue, 2);
+            while (packet_id + 1 - hsa_queue_load_read_index_scacquire(queue) >= queue->size);
+
+            hsa_barrier_and_packet_t* barrier_and_packet = (hsa_barrier_and_packet_t*) queue->base_address + packet_id % queue->size;
+            memset(((uint8_t*) barrier_and_packet) + 4, 0, sizeof(*barrier_and_packet) - 4);
+            barrier_and_packet->dep_signal[0] = copied[i];
+
+            hsa_kernel_dispatch_packet_t* packet = (hsa_kernel_dispatch_packet_t*) queue->base_address + (packet_id + 1) % queue->size;
+            initialize_packet(packet);
+            packet->workgroup_size_x = 1;
+            packet->grid_size_x = kWorkgroupsPerChunk;
+            hsa_cpu_queue_kernarg_allocate(queue, packet_id + 1, sizeof(read_args_t), &packet->kernarg_address);
+            read_args_t* args = (read_args_t*) packet->kernarg_address;
+            args->buffer = device + i * kChunkWords;
+            args->chunk_words = kChunkWords / kWorkgroupsPerChunk;
+            args->sums = sums + i * kWorkgroupsPerChunk;
+            packet->completion_signal = done;
+
+            // the dispatch goes first, so the packet processor never sees it before the barrier
+            packet_store_release((uint32_t*) packet, header(HSA_PACKET_TYPE_KERNEL_DISPATCH), kernel_dispatch_setup());
+            packet_store_release((uint32_t*) barrier_and_packet, header(HSA_PACKET_TYPE_BARRIER_AND), 0);
+            hsa_signal_store_screlease(queue->doorbell_signal, packet_id + 1);
+            if (!pipelined) {
+                while (hsa_signal_wait_scacquire(done, HSA_SIGNAL_CONDITION_EQ, kNumChunks - i - 1, UINT64_MAX, HSA_WAIT_STATE_BLOCKED) != kNumChunks - i - 1);
+            }
+        }
+        while (hsa_signal_wait_scacquire(done, HSA_SIGNAL_CONDITION_EQ, 0, UINT64_MAX, HSA_WAIT_STATE_BLOCKED) != 0);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        uint64_t total = 0;
+        for (uint32_t i = 0; i < kNumChunks * kWorkgroupsPerChunk; i++) {
+            total += sums[i];
+        }
+        uint64_t words = kNumChunks * kChunkWords;
+        assert(total == words * (words - 1) / 2);
+        printf("%s: %.1f ms\n", pipelined ? "Pipelined copy + compute" : "Serialized copy then compute", elapsed.count() * 1e3);
+        hsa_signal_destroy(done);
+    }
+
+    for (uint32_t i = 0; i < kNumChunks; i++) {
+        hsa_signal_destroy(copied[i]);
+    }
+    hsa_memory_free(sums);
+    hsa_memory_free(device);
+    hsa_memory_free(host);
+    hsa_queue_destroy(queue);
+    hsa_shut_down();
+}
+
+// Overlapping registrations share the pages they have in common: each stays valid until it is
+// deregistered itself, whatever happens to the other one.
+void overlapping_registrations() {
+    const size_t kPage = 4096;
+    char* buffer = (char*) malloc(8 * kPage);
+    assert(hsa_memory_register(buffer, 4 * kPage) == HSA_STATUS_SUCCESS);
+    assert(hsa_memory_register(buffer + 2 * kPage, 4 * kPage) == HSA_STATUS_SUCCESS);
+    assert(hsa_memory_deregister(buffer, 4 * kPage) == HSA_STATUS_SUCCESS);
+    // the first registration is gone, but the pages of the second one are still registered
+    assert(hsa_memory_deregister(buffer, 4 * kPage) == HSA_STATUS_ERROR_INVALID_ARGUMENT);
+    assert(hsa_memory_deregister(buffer + 2 * kPage, 4 * kPage) == HSA_STATUS_SUCCESS);
+    assert(hsa_memory_deregister(buffer + 2 * kPage, 4 * kPage) == HSA_STATUS_ERROR_INVALID_ARGUMENT);
+    free(buffer);
+}
+
+// An I/O loop registering the same set of receive buffers around every transfer. After the
+// first round, every registration is a cache hit.
+void registration_cycles() {
+    hsa_init();
+    overlapping_registrations();
+
+    const int kNumBuffers = 64;
+    const size_t kBufferSize = 64 * 1024;
+    const uint32_t kNumCycles = 1000 * 1000;
+    std::vector<void*> buffers;
+    for (int i = 0; i < kNumBuffers; i++) {
+        buffers.push_back(malloc(kBufferSize));
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < kNumCycles; i++) {
+        void* buffer = buffers[i % kNumBuffers];
+        hsa_memory_register(buffer, kBufferSize);
+        hsa_memory_deregister(buffer, kBufferSize);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    printf("%.0f register/deregister cycles/s\n", kNumCycles / elapsed.count());
+    for (int i = 0; i < kNumBuffers; i++) {
+        free(buffers[i]);
+    }
+    hsa_shut_down();
+}
+
+// Caches shared between agents show up under each of them with the same handle
+hsa_status_t print_cache(hsa_cache_t cache, void* data) {
+    uint32_t name_length = 0;
+    hsa_cache_get_info(cache, HSA_CACHE_INFO_NAME_LENGTH, &name_length);
+    std::vector<char> name(name_length);
+    hsa_cache_get_info(cache, HSA_CACHE_INFO_NAME, name.data());
+    uint32_t size = 0;
+    hsa_cache_get_info(cache, HSA_CACHE_INFO_SIZE, &size);
+    uint32_t line_size = 0;
+    hsa_cache_get_info(cache, HSA_CPU_CACHE_INFO_LINE_SIZE, &line_size);
+    printf("  %s %" PRIx64 ": %u KiB, %u-byte lines\n", name.data(), cache.handle, size / 1024, line_size);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t print_agent(hsa_agent_t agent, void* data) {
+    uint32_t features = 0;
+    hsa_agent_get_info(agent, HSA_AGENT_INFO_FEATURE, &features);
+    uint32_t node = 0;
+    hsa_agent_get_info(agent, HSA_AGENT_INFO_NODE, &node);
+    uint32_t queues_max = 0;
+    hsa_agent_get_info(agent, HSA_AGENT_INFO_QUEUES_MAX, &queues_max);
+    uint32_t cores = 0;
+    hsa_agent_get_info(agent, HSA_CPU_AGENT_INFO_COMPUTE_UNIT_COUNT, &cores);
+    uint32_t cpus = 0;
+    hsa_agent_get_info(agent, HSA_CPU_AGENT_INFO_CPU_COUNT, &cpus);
+    printf("%s agent: node %u, %u cores, %u CPUs, up to %u queues\n",
+           (features & HSA_AGENT_FEATURE_KERNEL_DISPATCH) ? "Kernel" : "Agent dispatch", node, cores, cpus, queues_max);
+    hsa_agent_iterate_caches(agent, print_cache, NULL);
+    return HSA_STATUS_SUCCESS;
+}
+
+// Agents built from the CPU topology, with their caches. Point HSA_SYSFS_ROOT at a fake sysfs tree such as
+// sysfs/two_sockets to try other machines, and HSA_CPU_AGENTS ("node", "socket" or CPU lists like "0-3;4-7")
+// to repartition.
+void topology() {
+    hsa_init();
+    hsa_iterate_agents(print_agent, NULL);
+    hsa_shut_down();
+}
+
+hsa_status_t collect_caches(hsa_cache_t cache, void* data) {
+    std::vector<hsa_cache_t>* caches = (std::vector<hsa_cache_t>*) data;
+    caches->push_back(cache);
+    return HSA_STATUS_SUCCESS;
+}
+
+// Checks the node, cores and CPUs of a kernel agent, and returns its caches
+std::vector<hsa_cache_t> check_agent(hsa_agent_t agent, uint32_t node, uint32_t cores, uint32_t cpus) {
+    uint32_t value = 0;
+    hsa_agent_get_info(agent, HSA_AGENT_INFO_NODE, &value);
+    assert(value == node);
+    hsa_agent_get_info(agent, HSA_CPU_AGENT_INFO_COMPUTE_UNIT_COUNT, &value);
+    assert(value == cores);
+    hsa_agent_get_info(agent, HSA_CPU_AGENT_INFO_CPU_COUNT, &value);
+    assert(value == cpus);
+    std::vector<hsa_cache_t> caches;
+    hsa_agent_iterate_caches(agent, collect_caches, &caches);
+    return caches;
+}
+
+// Caches listed by both agents, which must be the same objects
+std::vector<hsa_cache_t> shared_caches(const std::vector<hsa_cache_t>& a, const std::vector<hsa_cache_t>& b) {
+    std::vector<hsa_cache_t> shared;
+    for (size_t i = 0; i < a.size(); i++) {
+        for (size_t j = 0; j < b.size(); j++) {
+            if (a[i].handle == b[j].handle) {
+                shared.push_back(a[i]);
+            }
+        }
+    }
+    return shared;
+}
+
+// Agents built from the fake sysfs tree in sysfs/two_sockets: two packages, each a NUMA node with two
+// cores of two SMT siblings (CPUs n and n + 4). Every core has its own L1 and L2 caches, every package
+// an L3 cache.
+void fixture_topology() {
+    const char* slash = strrchr(__FILE__, '/');
+    char root[4096];
+    snprintf(root, sizeof(root), "%.*s/sysfs/two_sockets",
+             slash == NULL ? 1 : (int)(slash - __FILE__), slash == NULL ? "." : __FILE__);
+    setenv("HSA_SYSFS_ROOT", root, 1);
+
+    // an agent per node, with no cache in common
+    unsetenv("HSA_CPU_AGENTS");
+    hsa_init();
+    std::vector<hsa_agent_t> agents;
+    hsa_iterate_agents(accumulate_kernel_agents, &agents);
+    assert(agents.size() == 2);
+    std::vector<hsa_cache_t> caches0 = check_agent(agents[0], 0, 2, 4);
+    std::vector<hsa_cache_t> caches1 = check_agent(agents[1], 1, 2, 4);
+    assert(caches0.size() == 5 && caches1.size() == 5);
+    assert(shared_caches(caches0, caches1).empty());
+    hsa_shut_down();
+
+    // an agent per core of the first package, sharing its L3 cache only
+    setenv("HSA_CPU_AGENTS", "0,4;1,5", 1);
+    hsa_init();
+    agents.clear();
+    hsa_iterate_agents(accumulate_kernel_agents, &agents);
+    assert(agents.size() == 2);
+    caches0 = check_agent(agents[0], 0, 1, 2);
+    caches1 = check_agent(agents[1], 0, 1, 2);
+    assert(caches0.size() == 3 && caches1.size() == 3);
+    std::vector<hsa_cache_t> shared = shared_caches(caches0, caches1);
+    assert(shared.size() == 1);
+    uint8_t level = 0;
+    hsa_cache_get_info(shared[0], HSA_CACHE_INFO_LEVEL, &level);
+    assert(level == 3);
+    hsa_shut_down();
+    printf("Agents and caches match the topology of %s\n", root);
+}
+
+hsa_status_t print_wavefront(hsa_wavefront_t wavefront, void* data) {
+    uint32_t size = 0;
+    hsa_wavefront_get_info(wavefront, HSA_WAVEFRONT_INFO_SIZE, &size);
+    printf("    wavefront of %u work-items\n", size);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t print_isa(hsa_isa_t isa, void* data) {
+    uint32_t name_length = 0;
+    hsa_isa_get_info_alt(isa, HSA_ISA_INFO_NAME_LENGTH, &name_length);
+    std::vector<char> name(name_length);
+    hsa_isa_get_info_alt(isa, HSA_ISA_INFO_NAME, name.data());
+    uint32_t workgroup_max_size = 0;
+    hsa_isa_get_info_alt(isa, HSA_ISA_INFO_WORKGROUP_MAX_SIZE, &workgroup_max_size);
+    uint64_t grid_max_size = 0;
+    hsa_isa_get_info_alt(isa, HSA_ISA_INFO_GRID_MAX_SIZE, &grid_max_size);
+    printf("  %s: workgroups up to %u, grids up to %" PRIu64 " work-items\n", name.data(), workgroup_max_size, grid_max_size);
+    hsa_isa_iterate_wavefronts(isa, print_wavefront, NULL);
+    return HSA_STATUS_SUCCESS;
+}
+
+typedef struct saxpy_args_s {
+    float a;
+    const float* x;
+    float* y;
+} saxpy_args_t;
+
+// The same kernel compiled for several ISAs; the compiler vectorizes the loop over the work-items
+// with the vector width of each.
+#define SAXPY_BODY \
+    const saxpy_args_t* args = (const saxpy_args_t*) kernarg; \
+    for (uint32_t i = workgroup->begin[0]; i < workgroup->end[0]; i++) { \
+        args->y[i] += args->a * args->x[i]; \
+    }
+
+void saxpy_generic(void* kernarg, const hsa_cpu_workgroup_t* workgroup) {
+    SAXPY_BODY
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+__attribute__((target("avx2"))) void saxpy_avx2(void* kernarg, const hsa_cpu_workgroup_t* workgroup) {
+    SAXPY_BODY
+}
+
+__attribute__((target("avx512f"))) void saxpy_avx512f(void* kernarg, const hsa_cpu_workgroup_t* workgroup) {
+    SAXPY_BODY
+}
+#endif
+
+typedef struct kernel_variant_s {
+    const char* isa_name;
+    hsa_cpu_kernel_t kernel;
+} kernel_variant_t;
+
+const kernel_variant_t saxpy_variants[] = {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    {"CPU:x86-64-avx512f", saxpy_avx512f},
+    {"CPU:x86-64-avx2", saxpy_avx2},
+#endif
+    {"CPU:generic", saxpy_generic}
+};
+
+// The agent lists its ISAs widest vectors first, so the first ISA with a variant picks the widest
+// variant the CPUs can run
+hsa_status_t select_variant(hsa_isa_t isa, void* data) {
+    for (const kernel_variant_t& variant : saxpy_variants) {
+        hsa_isa_t variant_isa;
+        if (hsa_isa_from_name(variant.isa_name, &variant_isa) == HSA_STATUS_SUCCESS && variant_isa.handle == isa.handle) {
+            *((const kernel_variant_t**) data) = &variant;
+            return HSA_STATUS_INFO_BREAK;
+        }
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+// ISAs of the kernel agent, and a dispatch of the kernel variant built for the widest one
+void isa_selection() {
+    hsa_init();
+    hsa_agent_t* agents = get_kernel_agents();
+    printf("ISAs of the kernel agent:\n");
+    hsa_agent_iterate_isas(agents[0], print_isa, NULL);
+
+    const kernel_variant_t* variant = NULL;
+    hsa_agent_iterate_isas(agents[0], select_variant, &variant);
+    assert(variant != NULL);
+    printf("Selected the %s variant\n", variant->isa_name);
+
+    const uint32_t kSize = 1 << 20;
+    std::vector<float> x(kSize, 2.0f);
+    std::vector<float> y(kSize, 1.0f);
+    hsa_queue_t* queue;
+    hsa_queue_create(agents[0], 16, HSA_QUEUE_TYPE_SINGLE, NULL, NULL, 0, 0, &queue);
+    hsa_signal_t signal;
+    hsa_signal_create(1, 0, NULL, &signal);
+    uint64_t packet_id = hsa_queue_add_write_index_relaxed(queue, 1);
+    hsa_kernel_dispatch_packet_t* packet = (hsa_kernel_dispatch_packet_t*) queue->base_address + packet_id % queue->size;
+    initialize_packet(packet);
+    packet->kernel_object = (uint64_t) variant->kernel;
+    packet->workgroup_size_x = 4096;
+    packet->grid_size_x = kSize;
+    hsa_cpu_queue_kernarg_allocate(queue, packet_id, sizeof(saxpy_args_t), &packet->kernarg_address);
+    saxpy_args_t* args = (saxpy_args_t*) packet->kernarg_address;
+    args->a = 3.0f;
+    args->x = x.data();
+    args->y = y.data();
+    packet->completion_signal = signal;
+    packet_store_release((uint32_t*) packet, header(HSA_PACKET_TYPE_KERNEL_DISPATCH), kernel_dispatch_setup());
+    hsa_signal_store_screlease(queue->doorbell_signal, packet_id);
+    while (hsa_signal_wait_scacquire(signal, HSA_SIGNAL_CONDITION_EQ, 0, UINT64_MAX, HSA_WAIT_STATE_BLOCKED) != 0);
+    for (uint32_t i = 0; i < kSize; i++) {
+        assert(y[i] == 7.0f);
+    }
+    hsa_signal_destroy(signal);
+    hsa_queue_destroy(queue);
+    hsa_shut_down();
+}
+
+// Cost of reading the system timestamp, and how far it drifts from the steady clock over a minute
+void timestamp_drift() {
+    hsa_init();
+    uint64_t frequency = 0;
+    hsa_system_get_info(HSA_SYSTEM_INFO_TIMESTAMP_FREQUENCY, &frequency);
+    printf("Timestamp frequency: %" PRIu64 " Hz\n", frequency);
+
+    const int kReads = 10 * 1000 * 1000;
+    uint64_t timestamp = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kReads; i++) {
+        hsa_system_get_info(HSA_SYSTEM_INFO_TIMESTAMP, &timestamp);
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    printf("hsa_system_get_info(HSA_SYSTEM_INFO_TIMESTAMP): %.1f ns\n", elapsed.count() / kReads);
+    start = std::chrono::steady_clock::now();
+    uint64_t sum = 0;
+    for (int i = 0; i < kReads; i++) {
+        sum += std::chrono::steady_clock::now().time_since_epoch().count();
+    }
+    elapsed = std::chrono::steady_clock::now() - start;
+    printf("std::chrono::steady_clock::now(): %.1f ns\n", elapsed.count() / kReads + (sum == 0));
+
+    const int kSeconds = 60;
+    uint64_t first = 0;
+    hsa_system_get_info(HSA_SYSTEM_INFO_TIMESTAMP, &first);
+    start = std::chrono::steady_clock::now();
+    for (int s = 10; s <= kSeconds; s += 10) {
+        std::this_thread::sleep_until(start + std::chrono::seconds(s));
+        hsa_system_get_info(HSA_SYSTEM_INFO_TIMESTAMP, &timestamp);
+        elapsed = std::chrono::steady_clock::now() - start;
+        double drift = (timestamp - first) * 1e9 / frequency - elapsed.count();
+        printf("After %2d s: drift %+.1f us (%+.2f ppm)\n", s, drift / 1e3, drift / elapsed.count() * 1e6);
+    }
+    hsa_shut_down();
+}
+
+void empty(void* kernarg, const hsa_cpu_workgroup_t* workgroup) {
+}
+
+// Submits kNumPackets packets of an empty kernel in bursts that fill the queue, and returns the
+// packets per second retired, which is dominated by the per-packet cost of the runtime. With
+// profiling, also prints how long the packets waited in the queue and how long they executed.
+double profile_burst(hsa_queue_t* queue, bool profiling) {
+    const int kNumPackets = 20000;
+    hsa_cpu_queue_set_profiling(queue, profiling);
+    hsa_kernel_dispatch_packet_t* packets = (hsa_kernel_dispatch_packet_t*) queue->base_address;
+    hsa_signal_t signal;
+    hsa_signal_create(kNumPackets, 0, NULL, &signal);
+    uint64_t first = hsa_queue_load_write_index_relaxed(queue);
+    double wait = 0;
+    double execute = 0;
+    uint32_t recorded = 0;
+    uint64_t frequency = 0;
+    hsa_system_get_info(HSA_SYSTEM_INFO_TIMESTAMP_FREQUENCY, &frequency);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kNumPackets; i++) {
+        uint64_t packet_id = hsa_queue_add_write_index_relaxed(queue, 1);
+        while (packet_id - hsa_queue_load_read_index_scacquire(queue) >= queue->size);
+        if (profiling && packet_id >= first + queue->size) {
+            // the packet taking its slot has not been written yet, so the record is still there
+            hsa_cpu_dispatch_time_t time;
+            if (hsa_cpu_queue_get_dispatch_time(queue, packet_id - queue->size, &time) == HSA_STATUS_SUCCESS) {
+                wait += (double) (time.start - time.ready) / frequency;
+                execute += (double) (time.end - time.start) / frequency;
+                recorded++;
+            }
+        }
+        hsa_kernel_dispatch_packet_t* packet = packets + packet_id % queue->size;
+        initialize_packet(packet);
+        packet->workgroup_size_x = 1;
+        packet->grid_size_x = 1;
+        packet->completion_signal = signal;
+        // the barrier bit serializes the packets, so they queue up behind each other
+        packet_store_release((uint32_t*) packet, header(HSA_PACKET_TYPE_KERNEL_DISPATCH) | (1 << HSA_PACKET_HEADER_BARRIER), kernel_dispatch_setup());
+        hsa_signal_store_screlease(queue->doorbell_signal, packet_id);
+    }
+    while (hsa_signal_wait_scacquire(signal, HSA_SIGNAL_CONDITION_EQ, 0, UINT64_MAX, HSA_WAIT_STATE_BLOCKED) != 0);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (profiling && recorded != 0) {
+        printf("Average packet: %.1f us waiting in the queue, %.1f us executing\n", wait / recorded * 1e6, execute / recorded * 1e6);
+    }
+    hsa_signal_destroy(signal);
+    return kNumPackets / elapsed.count();
+}
+
+// Queue wait and execution time of dispatches, and the dispatch rate with and without profiling
+void dispatch_profiling() {
+    hsa_init();
+    hsa_agent_t* agents = get_kernel_agents();
+    hsa_queue_t* queue;
+    hsa_queue_create(agents[0], 64, HSA_QUEUE_TYPE_SINGLE, NULL, NULL, 0, 0, &queue);
+    profile_burst(queue, false);
+    double disabled = profile_burst(queue, false);
+    double enabled = profile_burst(queue, true);
+    printf("Dispatch rate: %.0f packets/s without profiling, %.0f packets/s with it\n", disabled, enabled);
+    hsa_queue_destroy(queue);
+    hsa_shut_down();
+}
+
+// Signal as the runtime used to implement it: every update takes a mutex and notifies a condition
+// variable, whether or not somebody waits
+typedef struct locked_signal_s {
+    std::atomic<hsa_signal_value_t> value;
+    std::mutex mutex;
+    std::condition_variable condition;
+} locked_signal_t;
+
+void locked_subtract(locked_signal_t* signal, hsa_signal_value_t value) {
+    std::lock_guard<std::mutex> lock(signal->mutex);
+    signal->value.fetch_sub(value, std::memory_order_release);
+    signal->condition.notify_all();
+}
+
+// Every thread decrements the same completion signal, as the workgroups of a dispatch do
+void signal_updates() {
+    hsa_init();
+    const int kOpsPerThread = 200 * 1000;
+    const int kThreadCounts[] = {1, 4, 32};
+    for (int num_threads : kThreadCounts) {
+        hsa_signal_t signal;
+        hsa_signal_create((hsa_signal_value_t) num_threads * kOpsPerThread, 0, NULL, &signal);
+        std::vector<std::thread> threads;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int i = 0; i < num_threads; i++) {
+            threads.push_back(std::thread([signal]() {
+                for (int j = 0; j < kOpsPerThread; j++) {
+                    hsa_signal_subtract_screlease(signal, 1);
+                }
+            }));
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        std::chrono::duration<double> lock_free = std::chrono::steady_clock::now() - start;
+        assert(hsa_signal_load_scacquire(signal) == 0);
+        hsa_signal_destroy(signal);
+
+        locked_signal_t locked;
+        locked.value = (hsa_signal_value_t) num_threads * kOpsPerThread;
+        threads.clear();
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < num_threads; i++) {
+            threads.push_back(std::thread([&locked]() {
+                for (int j = 0; j < kOpsPerThread; j++) {
+                    locked_subtract(&locked, 1);
+                }
+            }));
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        std::chrono::duration<double> mutex = std::chrono::steady_clock::now() - start;
+        assert(locked.value.load() == 0);
+
+        double ops = (double) num_threads * kOpsPerThread;
+        printf("%2d threads: %.1f Mops/s lock-free, %.1f Mops/s with mutex and condition variable\n",
+               num_threads, ops / lock_free.count() / 1e6, ops / mutex.count() / 1e6);
+    }
+    hsa_shut_down();
+}
+
+int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Time from a signal update to the return of a thread waiting for it, per wait state
+void wait_latency() {
+    hsa_init();
+    const int kSamples = 2000;
+    const hsa_wait_state_t kStates[] = {HSA_WAIT_STATE_ACTIVE, HSA_WAIT_STATE_BLOCKED};
+    for (hsa_wait_state_t state : kStates) {
+        hsa_signal_t signal;
+        hsa_signal_create(0, 0, NULL, &signal);
+        std::atomic<int64_t> stored_at(0);
+        std::atomic<int> acknowledged(0);
+        std::vector<double> latencies;
+        std::thread waiter([&]() {
+            for (int i = 1; i <= kSamples; i++) {
+                while (hsa_signal_wait_scacquire(signal, HSA_SIGNAL_CONDITION_GTE, i, UINT64_MAX, state) < i);
+                latencies.push_back((double) (now_ns() - stored_at.load(std::memory_order_acquire)));
+                acknowledged.store(i, std::memory_order_release);
+            }
+        });
+        for (int i = 1; i <= kSamples; i++) {
+            // give the waiter time to go through its spin budget
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+            stored_at.store(now_ns(), std::memory_order_release);
+            hsa_signal_store_screlease(signal, i);
+            while (acknowledged.load(std::memory_order_acquire) != i) {
+                std::this_thread::yield();
+            }
+        }
+        waiter.join();
+        hsa_signal_destroy(signal);
+
+        std::sort(latencies.begin(), latencies.end());
+        printf("%s waits: p50 %.1f us, p99 %.1f us\n", state == HSA_WAIT_STATE_ACTIVE ? "Active " : "Blocked",
+               latencies[kSamples / 2] / 1e3, latencies[kSamples * 99 / 100] / 1e3);
+    }
+    hsa_shut_down();
+}
+
+// Resident memory of the process in bytes
+size_t resident_bytes() {
+    size_t size = 0, resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm != NULL) {
+        if (fscanf(statm, "%zu %zu", &size, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Create/destroy throughput of pooled signals against individually allocated ones, and the memory
+// that a million live signals take in each case
+void signal_lifetime() {
+    hsa_init();
+    const int kCycles = 1000 * 1000;
+    const int kLiveSignals = 1000 * 1000;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kCycles; i++) {
+        hsa_signal_t signal;
+        hsa_signal_create(1, 0, NULL, &signal);
+        hsa_signal_destroy(signal);
+    }
+    std::chrono::duration<double> pooled = std::chrono::steady_clock::now() - start;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kCycles; i++) {
+        locked_signal_t* signal = new locked_signal_t();
+        signal->value = 1;
+        delete signal;
+    }
+    std::chrono::duration<double> allocated = std::chrono::steady_clock::now() - start;
+    printf("Create/destroy: %.1f M/s pooled, %.1f M/s with new/delete\n",
+           kCycles / pooled.count() / 1e6, kCycles / allocated.count() / 1e6);
+
+    std::vector<hsa_signal_t> signals(kLiveSignals);
+    size_t before = resident_bytes();
+    for (hsa_signal_t& signal : signals) {
+        hsa_signal_create(1, 0, NULL, &signal);
+    }
+    size_t pooled_bytes = resident_bytes() - before;
+    for (hsa_signal_t signal : signals) {
+        hsa_signal_destroy(signal);
+    }
+    std::vector<locked_signal_t*> locked(kLiveSignals);
+    before = resident_bytes();
+    for (locked_signal_t*& signal : locked) {
+        signal = new locked_signal_t();
+    }
+    size_t allocated_bytes = resident_bytes() - before;
+    for (locked_signal_t* signal : locked) {
+        delete signal;
+    }
+    printf("%d live signals: %zu MiB pooled, %zu MiB with new/delete\n", kLiveSignals,
+           pooled_bytes >> 20, allocated_bytes >> 20);
+    hsa_shut_down();
+}
+
+// Time from a signal update to the return of a thread waiting on a group that contains it, per
+// group size. The updated member changes every round.
+void group_wait_latency() {
+    hsa_init();
+    hsa_agent_t consumer = get_kernel_agents()[0];
+    const int kSamples = 2000;
+    const uint32_t kGroupSizes[] = {1, 64, 1024};
+    for (uint32_t num_signals : kGroupSizes) {
+        std::vector<hsa_signal_t> signals(num_signals);
+        for (hsa_signal_t& signal : signals) {
+            hsa_signal_create(0, 0, NULL, &signal);
+        }
+        hsa_signal_group_t group;
+        hsa_status_t status = hsa_signal_group_create(num_signals, signals.data(), 1, &consumer, &group);
+        assert(status == HSA_STATUS_SUCCESS);
+        std::vector<hsa_signal_condition_t> conditions(num_signals, HSA_SIGNAL_CONDITION_GTE);
+        std::vector<hsa_signal_value_t> compare_values(num_signals);
+        std::atomic<int64_t> stored_at(0);
+        std::atomic<int> acknowledged(0);
+        std::vector<double> latencies;
+        std::thread waiter([&]() {
+            for (int i = 1; i <= kSamples; i++) {
+                std::fill(compare_values.begin(), compare_values.end(), i);
+                hsa_signal_t signal;
+                hsa_signal_value_t value;
+                hsa_signal_group_wait_any_scacquire(group, conditions.data(), compare_values.data(),
+                                                    HSA_WAIT_STATE_BLOCKED, &signal, &value);
+                latencies.push_back((double) (now_ns() - stored_at.load(std::memory_order_acquire)));
+                acknowledged.store(i, std::memory_order_release);
+            }
+        });
+        for (int i = 1; i <= kSamples; i++) {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+            stored_at.store(now_ns(), std::memory_order_release);
+            hsa_signal_store_screlease(signals[(i * 7919) % num_signals], i);
+            while (acknowledged.load(std::memory_order_acquire) != i) {
+                std::this_thread::yield();
+            }
+        }
+        waiter.join();
+        hsa_signal_group_destroy(group);
+        for (hsa_signal_t signal : signals) {
+            hsa_signal_destroy(signal);
+        }
+
+        std::sort(latencies.begin(), latencies.end());
+        printf("%4u signals: p50 %.1f us, p99 %.1f us\n", num_signals,
+               latencies[kSamples / 2] / 1e3, latencies[kSamples * 99 / 100] / 1e3);
+    }
+    hsa_shut_down();
+}
+
+typedef struct skewed_args_s {
+    const uint32_t* costs_us;
+} skewed_args_t;
+
+// Every workgroup spins for its own cost
+void skewed(void* kernarg, const hsa_cpu_workgroup_t* workgroup) {
+    const skewed_args_t* args = (const skewed_args_t*) kernarg;
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() +
+        std::chrono::microseconds(args->costs_us[workgroup->id[0]]);
+    while (std::chrono::steady_clock::now() < end);
+}
+
+// Makespan of a dispatch whose workgroup costs follow a Pareto distribution, against the ideal
+// schedule on the CPUs of the agent and against a static split of the grid into equal ranges
+void skewed_makespan() {
+    hsa_init();
+    hsa_agent_t agent = get_kernel_agents()[0];
+    uint32_t cpus = 1;
+    hsa_agent_get_info(agent, HSA_CPU_AGENT_INFO_CPU_COUNT, &cpus);
+    const uint32_t kNumWorkgroups = 4096;
+    const double kMinCostUs = 5;
+    const double kShape = 1.5;
+    const uint32_t kMaxCostUs = 5000;
+    const int kNumRuns = 3;
+
+    std::vector<uint32_t> costs(kNumWorkgroups);
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    double total_us = 0, max_us = 0;
+    for (uint32_t& cost : costs) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        double uniform = ((state >> 11) + 1) * (1.0 / 9007199254740993.0);
+        double pareto = kMinCostUs / pow(uniform, 1 / kShape);
+        cost = pareto < kMaxCostUs ? (uint32_t) pareto : kMaxCostUs;
+        total_us += cost;
+        max_us = std::max(max_us, (double) cost);
+    }
+    double static_us = 0;
+    for (uint32_t cpu = 0; cpu < cpus; cpu++) {
+        double range_us = 0;
+        for (uint32_t i = cpu * kNumWorkgroups / cpus; i < (cpu + 1) * kNumWorkgroups / cpus; i++) {
+            range_us += costs[i];
+        }
+        static_us = std::max(static_us, range_us);
+    }
+    double ideal_us = std::max(total_us / cpus, max_us);
+
+    hsa_queue_t* queue;
+    hsa_queue_create(agent, 4, HSA_QUEUE_TYPE_SINGLE, NULL, NULL, 0, 0, &queue);
+    hsa_kernel_dispatch_packet_t* packets = (hsa_kernel_dispatch_packet_t*) queue->base_address;
+    hsa_signal_t signal;
+    hsa_signal_create(1, 0, NULL, &signal);
+    double makespan_us = 0;
+    for (int run = 0; run < kNumRuns; run++) {
+        hsa_signal_store_relaxed(signal, 1);
+        uint64_t packet_id = hsa_queue_add_write_index_relaxed(queue, 1);
+        hsa_kernel_dispatch_packet_t* packet = packets + packet_id % queue->size;
+        initialize_packet(packet);
+        packet->workgroup_size_x = 1;
+        packet->grid_size_x = kNumWorkgroups;
+        hsa_cpu_queue_kernarg_allocate(queue, packet_id, sizeof(skewed_args_t), &packet->kernarg_address);
+        ((skewed_args_t*) packet->kernarg_address)->costs_us = costs.data();
+        packet->completion_signal = signal;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        packet_store_release((uint32_t*) packet, header(HSA_PACKET_TYPE_KERNEL_DISPATCH), kernel_dispatch_setup());
+        hsa_signal_store_screlease(queue->doorbell_signal, packet_id);
+        while (hsa_signal_wait_scacquire(signal, HSA_SIGNAL_CONDITION_EQ, 0, UINT64_MAX, HSA_WAIT_STATE_BLOCKED) != 0);
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+        if (run == 0 || elapsed.count() < makespan_us) {
+            makespan_us = elapsed.count();
+        }
+    }
+    printf("%u workgroups on %u CPUs: makespan %.1f ms, ideal %.1f ms (%.2fx), static split %.1f ms\n",
+           kNumWorkgroups, cpus, makespan_us / 1e3, ideal_us / 1e3, makespan_us / ideal_us, static_us / 1e3);
+    hsa_signal_destroy(signal);
+    hsa_queue_destroy(queue);
+    hsa_shut_down();
+}
+
+// Aggregate packets per second of an agent as the packets are spread over more queues. The
+// queues share the packet processor threads of the agent.
+void queue_scaling() {
+    hsa_init();
+    hsa_agent_t agent = get_kernel_agents()[0];
+    const uint32_t kQueueCounts[] = {1, 16, 256};
+    const uint32_t kQueueSize = 64;
+    const int kNumPackets = 64 * 1024;
+    for (uint32_t num_queues : kQueueCounts) {
+        std::vector<hsa_queue_t*> queues(num_queues);
+        for (hsa_queue_t*& queue : queues) {
+            hsa_status_t status = hsa_queue_create(agent, kQueueSize, HSA_QUEUE_TYPE_SINGLE, NULL, NULL, 0, 0, &queue);
+            assert(status == HSA_STATUS_SUCCESS);
+        }
+        hsa_signal_t signal;
+        hsa_signal_create(kNumPackets, 0, NULL, &signal);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int i = 0; i < kNumPackets; i++) {
+            hsa_queue_t* queue = queues[i % num_queues];
+            uint64_t packet_id = hsa_queue_add_write_index_relaxed(queue, 1);
+            while (packet_id - hsa_queue_load_read_index_scacquire(queue) >= queue->size);
+            hsa_kernel_dispatch_packet_t* packet = (hsa_kernel_dispatch_packet_t*) queue->base_address + packet_id % queue->size;
+            initialize_packet(packet);
+            packet->completion_signal = signal;
+            packet_store_release((uint32_t*) packet, header(HSA_PACKET_TYPE_KERNEL_DISPATCH), kernel_dispatch_setup());
+            hsa_signal_store_screlease(queue->doorbell_signal, packet_id);
+        }
+        while (hsa_signal_wait_scacquire(signal, HSA_SIGNAL_CONDITION_EQ, 0, UINT64_MAX, HSA_WAIT_STATE_BLOCKED) != 0);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        printf("%3u queues: %.0f packets/s\n", num_queues, kNumPackets / elapsed.count());
+        hsa_signal_destroy(signal);
+        for (hsa_queue_t* queue : queues) {
+            hsa_queue_destroy(queue);
+        }
+    }
+    hsa_shut_down();
+}
+
+// The multithreaded dispatch pattern with more producers: packets per second retired from a single
+// queue that 1, 4 and 32 threads enqueue to concurrently
+void producer_contention() {
+    hsa_init();
+    counter = new std::atomic<int>(0);
+    hsa_agent_t kernel_agent;
+    hsa_iterate_agents(get_multi_kernel_agent, &kernel_agent);
+    const int kThreadCounts[] = {1, 4, 32};
+    for (int num_threads : kThreadCounts) {
+        hsa_queue_t *queue;
+        hsa_queue_create(kernel_agent, 256, HSA_QUEUE_TYPE_MULTI, NULL, NULL, 0, 0, &queue);
+        counter->store(0);
+        std::vector<std::thread> threads;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int i = 0; i < num_threads; i++) {
+            threads.push_back(std::thread(enqueue, queue));
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        assert(counter->load() == num_threads * 1000);
+        printf("%2d producers: %.0f packets/s\n", num_threads, counter->load() / elapsed.count());
+        hsa_queue_destroy(queue);
+    }
+    delete counter;
+    hsa_shut_down();
+}
+
+// Every workgroup runs the same number of steps of a xorshift generator
+void fixed_work(void* kernarg, const hsa_cpu_workgroup_t* workgroup) {
+    uint64_t state = workgroup->id[0] + 1;
+    for (uint32_t i = 0; i < 100000; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+    }
+    ((uint64_t*) kernarg)[workgroup->id[0]] = state;
+}
+
+// Workgroups per second of a fixed-work dispatch as the kernel agent grows from 1 to all the online
+// CPUs, doubling every time. HSA_CPU_AGENTS restricts the first kernel agent to CPUs 0 to n - 1.
+void core_scaling() {
+    const uint32_t kNumWorkgroups = 1024;
+    const int kNumRuns = 3;
+    const long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    std::vector<uint64_t> results(kNumWorkgroups);
+    double base_rate = 0;
+    for (long n = 1; n <= num_cpus; n = (n < num_cpus && 2 * n > num_cpus) ? num_cpus : 2 * n) {
+        char cpu_list[32];
+        snprintf(cpu_list, sizeof(cpu_list), "0-%ld", n - 1);
+        setenv("HSA_CPU_AGENTS", cpu_list, 1);
+        hsa_init();
+        hsa_agent_t agent = get_kernel_agents()[0];
+        uint32_t cores = 0;
+        hsa_agent_get_info(agent, HSA_CPU_AGENT_INFO_COMPUTE_UNIT_COUNT, &cores);
+        uint32_t cpus = 0;
+        hsa_agent_get_info(agent, HSA_CPU_AGENT_INFO_CPU_COUNT, &cpus);
+
+        hsa_queue_t* queue;
+        hsa_queue_create(agent, 4, HSA_QUEUE_TYPE_SINGLE, NULL, NULL, 0, 0, &queue);
+        hsa_kernel_dispatch_packet_t* packets = (hsa_kernel_dispatch_packet_t*) queue->base_address;
+        hsa_signal_t signal;
+        hsa_signal_create(1, 0, NULL, &signal);
+        double best_s = 0;
+        for (int run = 0; run < kNumRuns; run++) {
+            hsa_signal_store_relaxed(signal, 1);
+            uint64_t packet_id = hsa_queue_add_write_index_relaxed(queue, 1);
+            hsa_kernel_dispatch_packet_t* packet = packets + packet_id % queue->size;
+            initialize_packet(packet);
+            packet->workgroup_size_x = 1;
+            packet->grid_size_x = kNumWorkgroups;
+            packet->kernarg_address = results.data();
+            packet->completion_signal = signal;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            packet_store_release((uint32_t*) packet, header(HSA_PACKET_TYPE_KERNEL_DISPATCH), kernel_dispatch_setup());
+            hsa_signal_store_screlease(queue->doorbell_signal, packet_id);
+            while (hsa_signal_wait_scacquire(signal, HSA_SIGNAL_CONDITION_EQ, 0, UINT64_MAX, HSA_WAIT_STATE_BLOCKED) != 0);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            if (run == 0 || elapsed.count() < best_s) {
+                best_s = elapsed.count();
+            }
+        }
+        double rate = kNumWorkgroups / best_s;
+        if (n == 1) {
+            base_rate = rate;
+        }
+        printf("%3u CPUs (%u cores): %.0f workgroups/s, %.2fx\n", cpus, cores, rate, rate / base_rate);
+        hsa_signal_destroy(signal);
+        hsa_queue_destroy(queue);
+        hsa_shut_down();
+    }
+    unsetenv("HSA_CPU_AGENTS");
+}
+
 void barrier(){
     hsa_init();
 
@@ -458,7 +1789,7 @@ void process_agent_dispatch(hsa_queue_t* queue) {
 }
 
 // simulate an HSAIL kernel requesting N allocations from the host
-void allocate(void* kernarg) {
+void allocate(void* kernarg, const hsa_cpu_workgroup_t* workgroup) {
     hsa_queue_t* service_queue = (hsa_queue_t*)kernarg;
     void* ret = NULL;
 
@@ -581,10 +1912,87 @@ int main (int argc, char *argv[]) {
      kernarg_usage();
    } else if (test == 4) {
      printf("Test: Barrier packet\n");
-     barrier();
+     if (count_kernel_agents() < 2) {
+       printf("Needs two kernel agents, skipped\n");
+     } else {
+       barrier();
+     }
    } else if (test == 5) {
      printf("Test: Agent dispatch\n");
      agent_dispatch();
+   } else if (test == 6) {
+     printf("Test: Batched dispatch\n");
+     KERNEL_OBJECT = (uint64_t) increment;
+     batched_dispatch();
+   } else if (test == 7) {
+     printf("Test: Kernarg arena\n");
+     KERNEL_OBJECT = (uint64_t) increment_kernarg;
+     kernarg_arena();
+   } else if (test == 8) {
+     printf("Test: Memory churn\n");
+     memory_churn();
+   } else if (test == 9) {
+     printf("Test: Region bandwidth\n");
+     KERNEL_OBJECT = (uint64_t) read_chunk;
+     region_bandwidth();
+   } else if (test == 10) {
+     printf("Test: Random access\n");
+     KERNEL_OBJECT = (uint64_t) read_random;
+     random_access();
+   } else if (test == 11) {
+     printf("Test: Copy bandwidth\n");
+     copy_bandwidth();
+   } else if (test == 12) {
+     printf("Test: Copy and compute overlap\n");
+     KERNEL_OBJECT = (uint64_t) read_chunk;
+     copy_compute_overlap();
+   } else if (test == 13) {
+     printf("Test: Memory registration\n");
+     registration_cycles();
+   } else if (test == 14) {
+     printf("Test: Topology\n");
+     topology();
+   } else if (test == 15) {
+     printf("Test: ISA selection\n");
+     isa_selection();
+   } else if (test == 16) {
+     printf("Test: Timestamp\n");
+     timestamp_drift();
+   } else if (test == 17) {
+     printf("Test: Dispatch profiling\n");
+     KERNEL_OBJECT = (uint64_t) empty;
+     dispatch_profiling();
+   } else if (test == 18) {
+     printf("Test: Signal updates\n");
+     signal_updates();
+   } else if (test == 19) {
+     printf("Test: Wait latency\n");
+     wait_latency();
+   } else if (test == 20) {
+     printf("Test: Signal lifetime\n");
+     signal_lifetime();
+   } else if (test == 21) {
+     printf("Test: Signal group wait latency\n");
+     group_wait_latency();
+   } else if (test == 22) {
+     printf("Test: Skewed makespan\n");
+     KERNEL_OBJECT = (uint64_t) skewed;
+     skewed_makespan();
+   } else if (test == 23) {
+     printf("Test: Queue scaling\n");
+     KERNEL_OBJECT = (uint64_t) empty;
+     queue_scaling();
+   } else if (test == 24) {
+     printf("Test: Producer contention\n");
+     KERNEL_OBJECT = (uint64_t) increment;
+     producer_contention();
+   } else if (test == 25) {
+     printf("Test: Topology of a fake sysfs tree\n");
+     fixture_topology();
+   } else if (test == 26) {
+     printf("Test: Core scaling\n");
+     KERNEL_OBJECT = (uint64_t) fixed_work;
+     core_scaling();
    }
    return 1;
 }
@@ -1,23 +1,59 @@
 #define HSA_LARGE_MODEL 1
 #include "hsa.h"
+#include "hsa_cpu.h"
 
 
 #include <inttypes.h>
 #include <algorithm>
 #include <cassert>
+#include <climits> // INT_MAX
+#include <cstdio>
 #include <cstring> // memset
 #include <atomic>
-#include <condition_variable>
+#include <chrono>
+#include <deque>
 #include <functional>
+#include <map>
 #include <memory>
+#include <new> // placement new, std::bad_alloc
 #include <mutex>
+#include <set>
+#include <string>
 #include <thread>
 #include <vector>
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h> // _mm_pause
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h> // _BitScanForward64
+#endif
+
+#if defined(__x86_64__) && defined(__linux__) && (defined(__GNUC__) || defined(__clang__))
+#define HSA_TIMESTAMP_TSC 1
+#include <cpuid.h> // __get_cpuid
+#include <time.h> // clock_gettime
+#endif
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h> // MPOL_BIND
+#include <sched.h> // sched_setaffinity
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 namespace hsa {
 
   typedef void(*queue_callback_t)(hsa_status_t status, hsa_queue_t *queue, void* data);
-  typedef void(*dispatch_t)(void* args);
+
+  // Kernel invocations, and the packet times of profiled queues (see hsa_cpu.h)
+  typedef hsa_cpu_workgroup_t workgroup_t;
+  typedef hsa_cpu_kernel_t dispatch_t;
+  typedef hsa_cpu_dispatch_time_t dispatch_time_t;
 
   typedef struct packet_s {
     uint16_t header;
@@ -25,14 +61,214 @@ namespace hsa {
     hsa_signal_t completion_signal;
   } packet_t;
 
+  // Monotonic time in nanoseconds. Signal waits run on this clock; their timeouts are converted from
+  // timestamp ticks at the API.
+  static uint64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // Source of the system timestamp. With an invariant TSC the timestamp is the TSC, whose frequency
+  // is calibrated against CLOCK_MONOTONIC_RAW by Init; otherwise it is the monotonic clock. Either
+  // is shifted right until the frequency is within the 1-400 MHz the specification allows.
+  class Timestamp {
+  public:
+    Timestamp() : tsc_(false), shift_(2), frequency_(1000000000 >> 2) {
+    }
+
+    // Timestamps keep their meaning across hsa_init/hsa_shut_down cycles, so the TSC is only
+    // calibrated once
+    void Init() {
+#if defined(HSA_TIMESTAMP_TSC)
+      if (tsc_) {
+        return;
+      }
+      unsigned int eax, ebx, ecx, edx;
+      if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || (edx & (1u << 8)) == 0) {
+        return;
+      }
+      uint64_t tsc0 = 0, ns0 = 0, tsc1 = 0, ns1 = 0;
+      Sample(&tsc0, &ns0);
+      std::this_thread::sleep_for(std::chrono::milliseconds(kCalibrationMs));
+      Sample(&tsc1, &ns1);
+      if (tsc1 <= tsc0 || ns1 <= ns0) {
+        return;
+      }
+      double hz = (double)(tsc1 - tsc0) * 1e9 / (double)(ns1 - ns0);
+      uint32_t shift = 0;
+      while (hz / (double)(1ull << shift) > kMaxFrequency) {
+        shift++;
+      }
+      shift_ = shift;
+      frequency_ = (uint64_t)(hz / (double)(1ull << shift) + 0.5);
+      tsc_ = true;
+#endif
+    }
+
+    uint64_t Now() const {
+#if defined(HSA_TIMESTAMP_TSC)
+      if (tsc_) {
+        return __rdtsc() >> shift_;
+      }
+#endif
+      return NowNs() >> shift_;
+    }
+
+    // in Hz
+    uint64_t Frequency() const {
+      return frequency_;
+    }
+
+    // Converts a duration in timestamp ticks, such as a signal wait timeout, to nanoseconds
+    uint64_t ToNs(uint64_t ticks) const {
+      if (ticks == UINT64_MAX) {
+        return UINT64_MAX;
+      }
+      double ns = (double)ticks * 1e9 / (double)frequency_;
+      return ns >= (double)UINT64_MAX ? UINT64_MAX : (uint64_t)ns;
+    }
+
+  private:
+#if defined(HSA_TIMESTAMP_TSC)
+    // TSC and CLOCK_MONOTONIC_RAW read as close together as a few attempts allow
+    static void Sample(uint64_t* tsc, uint64_t* ns) {
+      uint64_t best = UINT64_MAX;
+      for (int i = 0; i < 16; i++) {
+        uint64_t before = __rdtsc();
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+        uint64_t after = __rdtsc();
+        if (after - before < best) {
+          best = after - before;
+          *tsc = before + (after - before) / 2;
+          *ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        }
+      }
+    }
+#endif
+
+    static constexpr uint32_t kCalibrationMs = 20;
+    static constexpr double kMaxFrequency = 400e6;
+
+    bool tsc_;
+    uint32_t shift_;
+    uint64_t frequency_;
+  };
+
+  constexpr uint32_t Timestamp::kCalibrationMs;
+  constexpr double Timestamp::kMaxFrequency;
+
+  static Timestamp timestamp_g;
+
+  static inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    _mm_pause();
+#endif
+  }
+
+  // Test-and-set lock for short critical sections; usable with std::lock_guard.
+  class SpinLock {
+  public:
+    SpinLock() : locked_(false) {
+    }
+
+    void lock() {
+      while (locked_.exchange(true, std::memory_order_acquire)) {
+        CpuRelax();
+      }
+    }
+
+    void unlock() {
+      locked_.store(false, std::memory_order_release);
+    }
+
+  private:
+    std::atomic<bool> locked_;
+  };
+
+  // Minimal wait-on-address primitive. FutexWait returns when *word no longer
+  // holds expected, when woken by FutexWake, after timeout_ns (UINT64_MAX for
+  // no limit), or spuriously; callers re-check their condition in a loop.
+  static void FutexWait(std::atomic<uint32_t>* word, uint32_t expected, uint64_t timeout_ns = UINT64_MAX) {
+#if defined(__linux__)
+    struct timespec ts;
+    struct timespec* timeout = nullptr;
+    if (timeout_ns != UINT64_MAX) {
+      ts.tv_sec = timeout_ns / 1000000000;
+      ts.tv_nsec = timeout_ns % 1000000000;
+      timeout = &ts;
+    }
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT_PRIVATE, expected, timeout, nullptr, 0);
+#else
+    std::this_thread::yield();
+#endif
+  }
+
+  static void FutexWake(std::atomic<uint32_t>* word) {
+#if defined(__linux__)
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#endif
+  }
+
+  // Object notified after every update of the signals it is attached to.
+  class SignalListener {
+  public:
+    virtual ~SignalListener() {
+    }
+
+    virtual void Notify() = 0;
+  };
+
+  // Attachment of a listener to a signal. Links are owned by whoever attaches the
+  // listener and are chained into the list of the signal.
+  struct SignalListenerLink {
+    SignalListener* listener;
+    SignalListenerLink* next;
+  };
+
+  // Futex-backed wake-up point for one or more sleeping threads. Attached to
+  // several signals, it lets a thread sleep once until any of them changes.
+  class Event : public SignalListener {
+  public:
+    Event() : waiters_(0), epoch_(0) {
+    }
+
+    // The updated signal already issued a seq_cst fence after its update
+    virtual void Notify() {
+      if (waiters_.load(std::memory_order_relaxed) != 0) {
+        epoch_.fetch_add(1, std::memory_order_release);
+        FutexWake(&epoch_);
+      }
+    }
+
+    // Sleeps until ready() returns true. ready() is re-evaluated after every notification.
+    template <typename Ready>
+    void Wait(Ready ready) {
+      waiters_.fetch_add(1, std::memory_order_seq_cst);
+      // pairs with the fence in Signal::Notify
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      while (true) {
+        uint32_t epoch = epoch_.load(std::memory_order_acquire);
+        if (ready()) {
+          break;
+        }
+        FutexWait(&epoch_, epoch);
+      }
+      waiters_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<uint32_t> waiters_;
+    std::atomic<uint32_t> epoch_;
+  };
+
   class Signal {
   public:
 
-    Signal() {
+    Signal() : val_(0), waiters_(0), epoch_(0), spin_ns_(kMinSpinNs), listeners_(nullptr) {
     }
 
-    Signal(hsa_signal_value_t val) {
-      val_ = val;
+    Signal(hsa_signal_value_t val) : val_(val), waiters_(0), epoch_(0), spin_ns_(kMinSpinNs), listeners_(nullptr) {
     }
 
     ~Signal() {
@@ -43,22 +279,19 @@ namespace hsa {
     }
 
     void Store(hsa_signal_value_t val, std::memory_order order) {
-      std::lock_guard<std::mutex> lock(mutex_);
       val_.store(val, order);
-      condition_.notify_all();
+      Notify();
     }
 
     hsa_signal_value_t Exchange(hsa_signal_value_t val, std::memory_order order) {
-      std::lock_guard<std::mutex> lock(mutex_);
       hsa_signal_value_t ret = val_.exchange(val, order);
-      condition_.notify_all();
+      Notify();
       return ret;
     }
 
     hsa_signal_value_t Cas(hsa_signal_value_t expected, hsa_signal_value_t val, std::memory_order order) {
-      std::lock_guard<std::mutex> lock(mutex_);
-      if (val_.compare_exchange_weak(expected, val, order)) {
-        condition_.notify_all();
+      if (val_.compare_exchange_strong(expected, val, order)) {
+        Notify();
       }
       return expected;
     }
@@ -67,359 +300,3645 @@ namespace hsa {
       if (value == 0) {
         return;
       }
-      std::lock_guard<std::mutex> lock(mutex_);
       val_.fetch_add(value, order);
-      condition_.notify_all();
+      Notify();
     }
 
     void Subtract(hsa_signal_value_t value, std::memory_order order) {
       if (value == 0) {
         return;
       }
-      std::lock_guard<std::mutex> lock(mutex_);
       val_.fetch_sub(value, order);
-      condition_.notify_all();
+      Notify();
     }
 
     void Or(hsa_signal_value_t value, std::memory_order order) {
       if (value == 0) {
         return;
       }
-      std::lock_guard<std::mutex> lock(mutex_);
       val_.fetch_or(value, order);
-      condition_.notify_all();
+      Notify();
     }
 
     void Xor(hsa_signal_value_t value, std::memory_order order) {
-      std::lock_guard<std::mutex> lock(mutex_);
       val_.fetch_xor(value, order);
-      condition_.notify_all();
+      Notify();
     }
 
-    // precondition: the caller holds a lock on mutex_
-    bool Satisfies(std::memory_order order, hsa_signal_condition_t condition, hsa_signal_value_t comp) {
+    static bool Satisfies(hsa_signal_value_t value, hsa_signal_condition_t condition, hsa_signal_value_t comp) {
       if (condition == HSA_SIGNAL_CONDITION_EQ) {
-        return val_.load(order) == comp;
+        return value == comp;
       }
       if (condition == HSA_SIGNAL_CONDITION_NE) {
-        return val_.load(order) != comp;
+        return value != comp;
       }
       if (condition == HSA_SIGNAL_CONDITION_LT) {
-        return val_.load(order) < comp;
+        return value < comp;
       }
       if (condition == HSA_SIGNAL_CONDITION_GTE) {
-        return val_.load(order) >= comp;
+        return value >= comp;
       }
       std::abort();
       return false;
     }
 
-    hsa_signal_value_t Wait(std::memory_order order, hsa_signal_condition_t condition, hsa_signal_value_t comp) {
-      std::unique_lock<std::mutex> lock(mutex_);
-      if (!Satisfies(order, condition, comp)) {
-        // no possible race condition between the check and the wait start since we are holding the lock
-        condition_.wait(lock, [&]{ return Satisfies(order, condition, comp); });
+    // Waits in up to three phases: spin with pause for the adaptive budget, yield
+    // for a few rounds, and finally sleep on the futex. ACTIVE waits never sleep.
+    // Returns the last observed value, which might not satisfy the condition if
+    // timeout_hint (in nanoseconds) elapsed first.
+    hsa_signal_value_t Wait(std::memory_order order, hsa_signal_condition_t condition, hsa_signal_value_t comp,
+      uint64_t timeout_hint = UINT64_MAX, hsa_wait_state_t wait_state = HSA_WAIT_STATE_BLOCKED) {
+      hsa_signal_value_t value = val_.load(order);
+      if (Satisfies(value, condition, comp)) {
+        return value;
+      }
+      const uint64_t start = NowNs();
+      const uint64_t deadline = (timeout_hint >= UINT64_MAX - start) ? UINT64_MAX : start + timeout_hint;
+      const uint64_t spin_deadline = std::min(deadline, start + 2 * (uint64_t)spin_ns_.load(std::memory_order_relaxed));
+
+      // spin phase; the clock is only read every kSpinCheckInterval iterations
+      uint64_t now = start;
+      for (uint32_t i = 1; ; i++) {
+        CpuRelax();
+        value = val_.load(order);
+        if (Satisfies(value, condition, comp)) {
+          Observe(NowNs() - start, false);
+          return value;
+        }
+        if (i % kSpinCheckInterval == 0) {
+          now = NowNs();
+          if (now >= spin_deadline) {
+            break;
+          }
+        }
       }
-      return val_.load(order);
-    }
-
-  private:
-    std::atomic<hsa_signal_value_t> val_;
-    std::mutex mutex_;
-    std::condition_variable condition_;
-  };
 
-  struct Queue {
-    Queue(hsa_agent_t agent,
-      uint32_t size,
-      hsa_queue_type_t type,
-      queue_callback_t callback,
-      void *data) {
-      packets_ = new packet_t[size];
-      memset(packets_, 0, size * sizeof(packet_t));
-      read_index_ = 0;
-      write_index_ = 0;
-      agent_ = agent;
-      callback_ = callback;
-      callback_data_ = data;
+      // yield phase. ACTIVE waits stay here until satisfied or timed out
+      for (uint32_t i = 0; wait_state == HSA_WAIT_STATE_ACTIVE || i < kYieldRounds; i++) {
+        if (now >= deadline) {
+          return value;
+        }
+        std::this_thread::yield();
+        value = val_.load(order);
+        now = NowNs();
+        if (Satisfies(value, condition, comp)) {
+          Observe(now - start, false);
+          return value;
+        }
+      }
 
-      q_.type = type;
-      hsa_agent_get_info(agent, HSA_AGENT_INFO_FEATURE, &(q_.features));
-      q_.base_address = packets_;
-      q_.doorbell_signal.handle = (uint64_t)&doorbell_;
+      // sleep phase
+      waiters_.fetch_add(1, std::memory_order_seq_cst);
+      // pairs with the fence in Notify: either the mutator sees us registered, or we see its update
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      while (true) {
+        uint32_t epoch = epoch_.load(std::memory_order_acquire);
+        value = val_.load(order);
+        if (Satisfies(value, condition, comp)) {
+          break;
+        }
+        now = NowNs();
+        if (now >= deadline) {
+          break;
+        }
+        FutexWait(&epoch_, epoch, deadline == UINT64_MAX ? UINT64_MAX : deadline - now);
+      }
+      waiters_.fetch_sub(1, std::memory_order_relaxed);
+      Observe(NowNs() - start, true);
+      return value;
+    }
 
-      q_.size = size;
-      q_.id = GetUniqueId();
+    // While a listener is attached, every update of the signal takes the slow path in Notify.
+    void AttachListener(SignalListenerLink* link) {
+      listeners_lock_.lock();
+      link->next = listeners_;
+      listeners_ = link;
+      listeners_lock_.unlock();
+      waiters_.fetch_add(kListener, std::memory_order_seq_cst);
+    }
 
-      if (!AgentDispatchQueue()) {
-        packet_processor_ = new std::thread(&Queue::Go, this);
-      } else {
-        // we need to set the initial value to some negative number
-        // otherwise, the application code waiting for the signal to become zero will get confused between
-        // unitialized doorbells and doorbells rang with ID zero
-        doorbell_.Store(-1, std::memory_order_release);
+    void DetachListener(SignalListenerLink* link) {
+      waiters_.fetch_sub(kListener, std::memory_order_seq_cst);
+      listeners_lock_.lock();
+      SignalListenerLink** curr = &listeners_;
+      while (*curr != link) {
+        curr = &(*curr)->next;
       }
+      *curr = link->next;
+      listeners_lock_.unlock();
     }
 
-    ~Queue() {
-      if (!AgentDispatchQueue()) {
-        packet_processor_->detach();
-        delete packet_processor_;
+  private:
+    // Called after every update. The kernel is only entered if some thread is sleeping in Wait,
+    // and listeners are only visited if some are attached.
+    void Notify() {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      uint32_t waiters = waiters_.load(std::memory_order_relaxed);
+      if (waiters == 0) {
+        return;
+      }
+      if (waiters & (kListener - 1)) {
+        // futex words are 32 bits wide, so sleepers wait on an epoch counter instead of the 64-bit value
+        epoch_.fetch_add(1, std::memory_order_release);
+        FutexWake(&epoch_);
+      }
+      if (waiters >= kListener) {
+        listeners_lock_.lock();
+        for (SignalListenerLink* link = listeners_; link != nullptr; link = link->next) {
+          link->listener->Notify();
+        }
+        listeners_lock_.unlock();
       }
-      delete[] packets_;
     }
 
-    Queue(const Queue& q) = delete;
-    Queue& operator=(Queue const&) = delete;
+    // Adapts the spin budget to the wait durations seen on this signal. Waits that
+    // had to sleep only pull the budget down, since their duration mostly measures
+    // how long we slept rather than how long the producer took.
+    void Observe(uint64_t elapsed_ns, bool slept) {
+      uint32_t budget = spin_ns_.load(std::memory_order_relaxed);
+      uint64_t sample = slept ? budget / 2 : std::min(elapsed_ns, (uint64_t)kMaxSpinNs);
+      // exponentially weighted moving average, 1/4 weight to the new sample
+      uint32_t next = (uint32_t)((3 * (uint64_t)budget + sample) / 4);
+      spin_ns_.store(next < kMinSpinNs ? kMinSpinNs : next, std::memory_order_relaxed);
+    }
 
-    static bool HasFence(uint16_t fence) {
-      return fence == HSA_FENCE_SCOPE_AGENT || fence == HSA_FENCE_SCOPE_SYSTEM;
+    static const uint32_t kSpinCheckInterval = 64;
+    static const uint32_t kYieldRounds = 16;
+    static const uint32_t kMinSpinNs = 1000;
+    static const uint32_t kMaxSpinNs = 100000;
+    // waiters_ counts direct sleepers in the low 16 bits and attached listeners above
+    static const uint32_t kListener = 1 << 16;
+
+    std::atomic<hsa_signal_value_t> val_;
+    std::atomic<uint32_t> waiters_;
+    std::atomic<uint32_t> epoch_;
+    std::atomic<uint32_t> spin_ns_;
+    SpinLock listeners_lock_;
+    SignalListenerLink* listeners_;
+  };
+
+  // Wait object behind hsa_signal_group_*. The group event is attached to every
+  // member signal, so a thread waiting on any of N signals sleeps once and each
+  // update costs O(1) regardless of N.
+  class SignalGroup {
+  public:
+    SignalGroup(uint32_t num_signals, const hsa_signal_t* signals);
+
+    ~SignalGroup() {
+      for (size_t i = 0; i < members_.size(); i++) {
+        members_[i]->DetachListener(&links_[i]);
+      }
     }
 
-    void DecrementCompletionSignal(packet_t& packet) {
-      if (packet.completion_signal.handle != 0) {
-        hsa::Signal* sig = (hsa::Signal*) packet.completion_signal.handle;
-        sig->Subtract(1, std::memory_order_release);
+    SignalGroup(const SignalGroup&) = delete;
+    SignalGroup& operator=(SignalGroup const&) = delete;
+
+    hsa_status_t WaitAny(std::memory_order order, const hsa_signal_condition_t* conditions,
+      const hsa_signal_value_t* compare_values, hsa_wait_state_t wait_state,
+      hsa_signal_t* signal, hsa_signal_value_t* value) {
+      size_t index;
+      const uint64_t spin_deadline = NowNs() + kSpinNs;
+      for (uint32_t i = 1; ; i++) {
+        if (Scan(order, conditions, compare_values, &index, value)) {
+          *signal = signals_[index];
+          return HSA_STATUS_SUCCESS;
+        }
+        if (wait_state == HSA_WAIT_STATE_ACTIVE) {
+          // ACTIVE waits never sleep; they only yield once the spin budget is gone
+          if (NowNs() < spin_deadline) {
+            CpuRelax();
+          } else {
+            std::this_thread::yield();
+          }
+        } else if (i % kSpinCheckInterval != 0 || NowNs() < spin_deadline) {
+          CpuRelax();
+        } else {
+          break;
+        }
       }
+
+      event_.Wait([&] { return Scan(order, conditions, compare_values, &index, value); });
+      *signal = signals_[index];
+      return HSA_STATUS_SUCCESS;
     }
 
-    bool ProcessDispatch(hsa_kernel_dispatch_packet_t& packet) {
-      if (packet.setup == 0) { // dimensions
-        if (callback_) {
-          callback_(HSA_STATUS_ERROR_INVALID_PACKET_FORMAT, &q_, callback_data_);
+  private:
+    bool Scan(std::memory_order order, const hsa_signal_condition_t* conditions,
+      const hsa_signal_value_t* compare_values, size_t* index, hsa_signal_value_t* value) {
+      for (size_t i = 0; i < members_.size(); i++) {
+        hsa_signal_value_t curr = members_[i]->Load(order);
+        if (Signal::Satisfies(curr, conditions[i], compare_values[i])) {
+          *index = i;
+          *value = curr;
+          return true;
         }
-        return false;
       }
-      // other checks...
+      return false;
+    }
 
-      // 'barrier' bit is ignored because we are completing dispatches in order
+    static const uint32_t kSpinCheckInterval = 16;
+    static const uint64_t kSpinNs = 10000;
 
-      std::atomic_thread_fence(std::memory_order_acquire);
+    std::vector<hsa_signal_t> signals_;
+    std::vector<Signal*> members_;
+    std::vector<SignalListenerLink> links_;
+    Event event_;
+  };
 
-      dispatch_t func = (dispatch_t)packet.kernel_object;
-      func(packet.kernarg_address);
-      std::atomic_thread_fence(std::memory_order_release);
-      DecrementCompletionSignal((packet_t&)packet);
-      return true;
+  static void* AlignedAlloc(size_t size, size_t alignment) {
+#if defined(_MSC_VER)
+    return _aligned_malloc(size, alignment);
+#else
+    void* ptr = nullptr;
+    return posix_memalign(&ptr, alignment, size) == 0 ? ptr : nullptr;
+#endif
+  }
+
+  static void AlignedFree(void* ptr) {
+#if defined(_MSC_VER)
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+  }
+
+  static size_t PageSize() {
+#if defined(__linux__)
+    return (size_t)sysconf(_SC_PAGESIZE);
+#else
+    return 4096;
+#endif
+  }
+
+  static const size_t kHugePageSize = 2 * 1024 * 1024;
+
+  static const int kAnyNode = -1;
+
+#if defined(__linux__)
+  // Binding is best effort: mbind fails for nodes without memory (or unknown to the kernel, as
+  // with a fake sysfs tree), and the pages are then placed by the default policy.
+  static void BindPages(void* ptr, size_t size, int node) {
+    if (node == kAnyNode) {
+      return;
     }
+    const size_t bits = 8 * sizeof(unsigned long);
+    std::vector<unsigned long> mask(node / bits + 1, 0);
+    mask[node / bits] = 1ul << (node % bits);
+    syscall(SYS_mbind, ptr, size, MPOL_BIND, mask.data(), mask.size() * bits + 1, 0);
+  }
+#endif
 
-    bool ProcessBarrier(hsa_barrier_and_packet_t& packet) {
-      for (int i = 0; i < 5; i++) {
-        uint64_t dep = packet.dep_signal[i].handle;
-        if (dep != 0) {
-          hsa::Signal* sig = (hsa::Signal*) dep;
-          sig->Wait(std::memory_order_acquire, HSA_SIGNAL_CONDITION_EQ, 0);
-        }
-      }
-      std::atomic_thread_fence(std::memory_order_release);
-      DecrementCompletionSignal((packet_t&)packet);
-      return true;
+  // Maps size bytes (a multiple of the page size) aligned to alignment. Unless node is kAnyNode,
+  // the pages are bound to that NUMA node before they are first touched.
+  static void* MapPages(size_t size, size_t alignment, int node) {
+#if defined(__linux__)
+    size_t length = size + alignment;
+    uint8_t* map = (uint8_t*)mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+      return nullptr;
     }
+    // trim the mapping down to the aligned range
+    uint8_t* ptr = (uint8_t*)(((uintptr_t)map + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    if (ptr != map) {
+      munmap(map, ptr - map);
+    }
+    if (ptr + size != map + length) {
+      munmap(ptr + size, map + length - (ptr + size));
+    }
+    BindPages(ptr, size, node);
+    return ptr;
+#else
+    return AlignedAlloc(size, alignment);
+#endif
+  }
 
-    static void clear_field(uint16_t* header, unsigned int start, unsigned int width) {
-      *header &= ~(((1 << width) - 1) << start);
+  // Maps size bytes (a multiple of kHugePageSize) on huge pages bound to node: explicit huge
+  // pages when some are reserved, otherwise regular pages the kernel is asked to back with
+  // transparent huge pages.
+  static void* MapHugePages(size_t size, int node) {
+#if defined(__linux__)
+#if defined(MAP_HUGETLB)
+    void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED) {
+      BindPages(ptr, size, node);
+      return ptr;
+    }
+#endif
+    void* pages = MapPages(size, kHugePageSize, node);
+#if defined(MADV_HUGEPAGE)
+    if (pages != nullptr) {
+      madvise(pages, size, MADV_HUGEPAGE);
     }
+#endif
+    return pages;
+#else
+    return MapPages(size, kHugePageSize, node);
+#endif
+  }
 
-    static unsigned int get_field(uint16_t header, unsigned int start, unsigned int width) {
-      return (header >> start) & ((1 << width) - 1);
+  static void UnmapPages(void* ptr, size_t size) {
+#if defined(__linux__)
+    munmap(ptr, size);
+#else
+    AlignedFree(ptr);
+#endif
+  }
+
+  // Root of the sysfs tree the host topology is read from, overridden by HSA_SYSFS_ROOT (for
+  // example, to point the runtime at a fake tree)
+  static std::string SysfsRoot() {
+    const char* root = getenv("HSA_SYSFS_ROOT");
+    return root != nullptr ? root : "/sys";
+  }
+
+  static bool ReadFile(const std::string& path, std::string* contents) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (file == nullptr) {
+      return false;
+    }
+    char buffer[4096];
+    size_t count;
+    contents->clear();
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+      contents->append(buffer, count);
     }
+    fclose(file);
+    return true;
+  }
 
-    static void set_field(uint16_t* header, unsigned int start, unsigned int width, unsigned int value) {
-      clear_field(header, start, width);
-      *header |= (value << start);
+  // Parses a sysfs CPU or node list such as "0-3,8,10-11"
+  static std::vector<uint32_t> ParseList(const std::string& list) {
+    std::vector<uint32_t> ids;
+    const char* curr = list.c_str();
+    while (*curr >= '0' && *curr <= '9') {
+      char* end;
+      uint32_t first = (uint32_t)strtoul(curr, &end, 10);
+      uint32_t last = first;
+      if (*end == '-') {
+        last = (uint32_t)strtoul(end + 1, &end, 10);
+      }
+      for (uint32_t id = first; id <= last; id++) {
+        ids.push_back(id);
+      }
+      curr = (*end == ',') ? end + 1 : end;
     }
+    return ids;
+  }
 
-    void Go() {
-      bool ok = true;
-      while (ok) {
-        size_t curr = read_index_ % q_.size;
-        packet_t* packet = packets_ + curr;
+  struct NumaNode {
+    uint32_t id;
+    std::vector<uint32_t> cpus;
+    // bytes of memory attached to the node, zero if unknown
+    uint64_t memory;
+  };
 
-        while (get_field(packet->header, HSA_PACKET_HEADER_TYPE, HSA_PACKET_HEADER_WIDTH_TYPE) <= HSA_PACKET_TYPE_INVALID);
-        hsa_packet_type_t type = (hsa_packet_type_t) get_field(packet->header, HSA_PACKET_HEADER_TYPE, HSA_PACKET_HEADER_WIDTH_TYPE);
-        if (type == HSA_PACKET_TYPE_KERNEL_DISPATCH) {
-          ok &= ProcessDispatch(*((hsa_kernel_dispatch_packet_t*)packet));
-        } else if (type == HSA_PACKET_TYPE_BARRIER_AND) {
-          ok &= ProcessBarrier(*((hsa_barrier_and_packet_t*)packet));
-        } else {
-          // packet format invalid (including agent dispatch)
-          printf("Unknown type: %u\n", type);
-          std::abort();
+  // Reads the memory nodes of the host from <sysfs root>/devices/system/node. Without that
+  // directory (or outside Linux), the host is a single node 0.
+  static std::vector<NumaNode> DiscoverNumaNodes() {
+    std::vector<NumaNode> nodes;
+#if defined(__linux__)
+    std::string dir = SysfsRoot() + "/devices/system/node";
+    DIR* stream = opendir(dir.c_str());
+    if (stream != nullptr) {
+      std::map<uint32_t, NumaNode> sorted;
+      while (struct dirent* entry = readdir(stream)) {
+        char* end;
+        if (strncmp(entry->d_name, "node", 4) != 0 || entry->d_name[4] < '0' || entry->d_name[4] > '9') {
+          continue;
+        }
+        uint32_t id = (uint32_t)strtoul(entry->d_name + 4, &end, 10);
+        if (*end != '\0') {
+          continue;
+        }
+        NumaNode node;
+        node.id = id;
+        node.memory = 0;
+        std::string path = dir + "/" + entry->d_name;
+        std::string contents;
+        if (ReadFile(path + "/cpulist", &contents)) {
+          node.cpus = ParseList(contents);
         }
-        set_field(&packet->header, HSA_PACKET_HEADER_TYPE, HSA_PACKET_HEADER_WIDTH_TYPE, HSA_PACKET_TYPE_INVALID);
-        read_index_++;
+        // "Node <id> MemTotal:  <size> kB"
+        if (ReadFile(path + "/meminfo", &contents)) {
+          size_t pos = contents.find("MemTotal:");
+          if (pos != std::string::npos) {
+            node.memory = strtoull(contents.c_str() + pos + strlen("MemTotal:"), nullptr, 10) * 1024;
+          }
+        }
+        sorted[id] = node;
+      }
+      closedir(stream);
+      for (std::map<uint32_t, NumaNode>::iterator it = sorted.begin(); it != sorted.end(); ++it) {
+        nodes.push_back(it->second);
       }
     }
-
-    uint64_t LoadReadIndex(std::memory_order order) const {
-      return read_index_.load(order);
+#endif
+    if (nodes.empty()) {
+      NumaNode node;
+      node.id = 0;
+      node.memory = 0;
+      for (uint32_t cpu = 0; cpu < std::max(std::thread::hardware_concurrency(), 1u); cpu++) {
+        node.cpus.push_back(cpu);
+      }
+      nodes.push_back(node);
     }
+    return nodes;
+  }
 
-    void StoreReadIndex(uint64_t value, std::memory_order order) {
-      if (!AgentDispatchQueue()) {
-        std::abort();
+  struct Cpu {
+    uint32_t id;
+    uint32_t package;
+    uint32_t core;
+    uint32_t node;
+  };
+
+  // Reads the online CPUs from <sysfs root>/devices/system/cpu, with the package and core each
+  // belongs to; SMT siblings share both. Without sysfs every CPU is a core of its own.
+  static std::vector<Cpu> DiscoverCpus(const std::vector<NumaNode>& nodes) {
+    std::string dir = SysfsRoot() + "/devices/system/cpu";
+    std::string contents;
+    std::vector<uint32_t> online;
+    if (ReadFile(dir + "/online", &contents)) {
+      online = ParseList(contents);
+    }
+    if (online.empty()) {
+      for (uint32_t cpu = 0; cpu < std::max(std::thread::hardware_concurrency(), 1u); cpu++) {
+        online.push_back(cpu);
       }
-      read_index_.store(value, order);
     }
-
-    uint64_t LoadWriteIndex(std::memory_order order) const {
-      return write_index_.load(order);
+    std::vector<Cpu> cpus;
+    for (size_t i = 0; i < online.size(); i++) {
+      Cpu cpu;
+      cpu.id = online[i];
+      cpu.package = 0;
+      cpu.core = cpu.id;
+      std::string topology = dir + "/cpu" + std::to_string(cpu.id) + "/topology";
+      if (ReadFile(topology + "/physical_package_id", &contents)) {
+        cpu.package = (uint32_t)strtoul(contents.c_str(), nullptr, 10);
+      }
+      if (ReadFile(topology + "/core_id", &contents)) {
+        cpu.core = (uint32_t)strtoul(contents.c_str(), nullptr, 10);
+      }
+      cpu.node = nodes[0].id;
+      for (size_t n = 0; n < nodes.size(); n++) {
+        if (std::find(nodes[n].cpus.begin(), nodes[n].cpus.end(), cpu.id) != nodes[n].cpus.end()) {
+          cpu.node = nodes[n].id;
+        }
+      }
+      cpus.push_back(cpu);
     }
+    return cpus;
+  }
 
-    void StoreWriteIndex(uint64_t value, std::memory_order order) {
-      write_index_.store(value, order);
-    }
+  // CPUs of one kernel agent
+  struct CpuPartition {
+    uint32_t node;
+    std::vector<uint32_t> cpus;
+    // physical cores among the CPUs
+    uint32_t num_cores;
+  };
 
-    uint64_t CasWriteIndex(uint64_t expected, uint64_t value, std::memory_order order) {
-      write_index_.compare_exchange_strong(expected, value, order);
-      return expected;
+  // One partition per CPU list, skipping CPUs that are offline or in an earlier partition
+  static std::vector<CpuPartition> MakePartitions(const std::vector<Cpu>& cpus, const std::vector<std::vector<uint32_t>>& lists) {
+    std::vector<CpuPartition> partitions;
+    std::vector<bool> taken(cpus.size(), false);
+    for (size_t l = 0; l < lists.size(); l++) {
+      CpuPartition partition;
+      partition.node = 0;
+      std::vector<std::pair<uint32_t, uint32_t>> cores;
+      for (size_t c = 0; c < lists[l].size(); c++) {
+        for (size_t i = 0; i < cpus.size(); i++) {
+          if (cpus[i].id != lists[l][c] || taken[i]) {
+            continue;
+          }
+          taken[i] = true;
+          if (partition.cpus.empty()) {
+            partition.node = cpus[i].node;
+          }
+          partition.cpus.push_back(cpus[i].id);
+          std::pair<uint32_t, uint32_t> core(cpus[i].package, cpus[i].core);
+          if (std::find(cores.begin(), cores.end(), core) == cores.end()) {
+            cores.push_back(core);
+          }
+        }
+      }
+      partition.num_cores = (uint32_t)cores.size();
+      if (!partition.cpus.empty()) {
+        partitions.push_back(partition);
+      }
     }
+    return partitions;
+  }
 
-    uint64_t AddWriteIndex(uint64_t value, std::memory_order order) {
-      return write_index_.fetch_add(value, order);
+  // Splits the CPUs into disjoint partitions, one per kernel agent. HSA_CPU_AGENTS selects how:
+  // "node" (the default) makes one partition per NUMA node with CPUs, "socket" one per package,
+  // and a list of CPU lists such as "0-3,8-11;4-7,12-15" one per list. A CPU listed twice
+  // belongs to the first partition only; offline CPUs are dropped. As many applications expect
+  // two kernel agents, the default policy splits a single node in two partitions of whole cores
+  // (SMT siblings stay together), unless it has only one core.
+  static std::vector<CpuPartition> PartitionCpus(const std::vector<Cpu>& cpus) {
+    const char* env = getenv("HSA_CPU_AGENTS");
+    std::string policy = (env != nullptr) ? env : "node";
+    std::vector<std::vector<uint32_t>> lists;
+    if (policy == "node" || policy == "socket") {
+      std::map<uint32_t, std::vector<uint32_t>> groups;
+      for (size_t i = 0; i < cpus.size(); i++) {
+        groups[policy == "node" ? cpus[i].node : cpus[i].package].push_back(cpus[i].id);
+      }
+      for (std::map<uint32_t, std::vector<uint32_t>>::iterator it = groups.begin(); it != groups.end(); ++it) {
+        lists.push_back(it->second);
+      }
+    } else {
+      size_t begin = 0;
+      while (begin <= policy.size()) {
+        size_t end = policy.find(';', begin);
+        end = (end == std::string::npos) ? policy.size() : end;
+        lists.push_back(ParseList(policy.substr(begin, end - begin)));
+        begin = end + 1;
+      }
+    }
+
+    std::vector<CpuPartition> partitions = MakePartitions(cpus, lists);
+    if (partitions.empty()) {
+      // nothing usable in HSA_CPU_AGENTS: a single agent with every CPU
+      std::vector<uint32_t> all;
+      for (size_t i = 0; i < cpus.size(); i++) {
+        all.push_back(cpus[i].id);
+      }
+      partitions = MakePartitions(cpus, std::vector<std::vector<uint32_t>>(1, all));
+    }
+    if (env == nullptr && partitions.size() == 1 && partitions[0].num_cores > 1) {
+      // the CPUs of each core, cores in order of their first CPU
+      std::vector<std::pair<uint32_t, uint32_t>> cores;
+      std::vector<std::vector<uint32_t>> siblings;
+      for (size_t i = 0; i < cpus.size(); i++) {
+        if (std::find(partitions[0].cpus.begin(), partitions[0].cpus.end(), cpus[i].id) == partitions[0].cpus.end()) {
+          continue;
+        }
+        std::pair<uint32_t, uint32_t> core(cpus[i].package, cpus[i].core);
+        size_t c = std::find(cores.begin(), cores.end(), core) - cores.begin();
+        if (c == cores.size()) {
+          cores.push_back(core);
+          siblings.push_back(std::vector<uint32_t>());
+        }
+        siblings[c].push_back(cpus[i].id);
+      }
+      std::vector<std::vector<uint32_t>> halves(2);
+      for (size_t c = 0; c < siblings.size(); c++) {
+        std::vector<uint32_t>& half = halves[c < siblings.size() / 2 ? 0 : 1];
+        half.insert(half.end(), siblings[c].begin(), siblings[c].end());
+      }
+      partitions = MakePartitions(cpus, halves);
+    }
+    return partitions;
+  }
+
+  // Restricts the calling thread to cpus (all of them if empty). Best effort: CPU IDs unknown
+  // to the kernel, as with a fake sysfs tree, are ignored.
+  static void PinThread(const std::vector<uint32_t>& cpus) {
+#if defined(__linux__)
+    if (cpus.empty()) {
+      return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < cpus.size(); i++) {
+      if (cpus[i] < CPU_SETSIZE) {
+        CPU_SET(cpus[i], &set);
+      }
+    }
+    sched_setaffinity(0, sizeof(set), &set);
+#endif
+  }
+
+  // Data or unified cache shared by a set of CPUs. Agents whose CPUs share a cache report the
+  // same object.
+  class Cache {
+  public:
+    Cache(uint8_t level, const std::string& type, uint32_t size, uint32_t line_size, const std::vector<uint32_t>& cpus) :
+      level_(level), size_(size), line_size_(line_size), cpus_(cpus) {
+      name_ = "L" + std::to_string(level) + " " + type + " cache";
+    }
+
+    hsa_status_t Get(hsa_cache_info_t attribute, void* value) const {
+      if (attribute == HSA_CPU_CACHE_INFO_LINE_SIZE) {
+        uint32_t* dst = (uint32_t*)value;
+        *dst = line_size_;
+        return HSA_STATUS_SUCCESS;
+      }
+      switch (attribute) {
+      case HSA_CACHE_INFO_NAME_LENGTH: {
+        uint32_t* dst = (uint32_t*)value;
+        *dst = (uint32_t)name_.size() + 1;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_CACHE_INFO_NAME: {
+        char* dst = (char*)value;
+        memcpy(dst, name_.c_str(), name_.size() + 1);
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_CACHE_INFO_LEVEL: {
+        uint8_t* dst = (uint8_t*)value;
+        *dst = level_;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_CACHE_INFO_SIZE: {
+        uint32_t* dst = (uint32_t*)value;
+        *dst = size_;
+        return HSA_STATUS_SUCCESS;
+      }
+      default: return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+      }
+      return HSA_STATUS_SUCCESS;
+    }
+
+    uint8_t Level() const {
+      return level_;
+    }
+
+    uint32_t Size() const {
+      return size_;
+    }
+
+    // True if one of cpus shares the cache
+    bool Serves(const std::vector<uint32_t>& cpus) const {
+      for (size_t i = 0; i < cpus.size(); i++) {
+        if (std::find(cpus_.begin(), cpus_.end(), cpus[i]) != cpus_.end()) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+  private:
+    std::string name_;
+    uint8_t level_;
+    uint32_t size_;
+    uint32_t line_size_;
+    std::vector<uint32_t> cpus_;
+  };
+
+  // Reads the data and unified caches of the CPUs from <sysfs root>/devices/system/cpu/cpu*/cache.
+  // A cache shared by several CPUs is listed by each of them and becomes a single object.
+  static std::vector<Cache*> DiscoverCaches(const std::vector<Cpu>& cpus) {
+    std::vector<Cache*> caches;
+    std::vector<std::pair<uint32_t, std::vector<uint32_t>>> seen;
+    std::string dir = SysfsRoot() + "/devices/system/cpu";
+    for (size_t c = 0; c < cpus.size(); c++) {
+      for (uint32_t index = 0; ; index++) {
+        std::string path = dir + "/cpu" + std::to_string(cpus[c].id) + "/cache/index" + std::to_string(index);
+        std::string level, type, size, line_size, shared;
+        if (!ReadFile(path + "/level", &level) || !ReadFile(path + "/type", &type)) {
+          break;
+        }
+        type = type.substr(0, type.find('\n'));
+        if (type == "Instruction") {
+          continue;
+        }
+        std::vector<uint32_t> sharing;
+        if (ReadFile(path + "/shared_cpu_list", &shared)) {
+          sharing = ParseList(shared);
+        }
+        if (sharing.empty()) {
+          sharing.push_back(cpus[c].id);
+        }
+        std::pair<uint32_t, std::vector<uint32_t>> key((uint32_t)strtoul(level.c_str(), nullptr, 10), sharing);
+        if (std::find(seen.begin(), seen.end(), key) != seen.end()) {
+          continue;
+        }
+        seen.push_back(key);
+        // "48K", "2048K", "32M"
+        uint64_t bytes = 0;
+        if (ReadFile(path + "/size", &size)) {
+          char* unit;
+          bytes = strtoull(size.c_str(), &unit, 10);
+          bytes <<= (*unit == 'K') ? 10 : (*unit == 'M') ? 20 : (*unit == 'G') ? 30 : 0;
+        }
+        uint32_t line = 0;
+        if (ReadFile(path + "/coherency_line_size", &line_size)) {
+          line = (uint32_t)strtoul(line_size.c_str(), nullptr, 10);
+        }
+        caches.push_back(new Cache((uint8_t)key.first, type == "Data" ? "data" : "unified", bytes > UINT32_MAX ? UINT32_MAX : (uint32_t)bytes, line, sharing));
+      }
+    }
+    return caches;
+  }
+
+  // A wavefront of the CPU runtime is the group of work-items one vector instruction covers: the
+  // number of 32-bit lanes of the vector registers the ISA uses.
+  class Wavefront {
+  public:
+    explicit Wavefront(uint32_t size) : size_(size) {}
+
+    hsa_status_t Get(hsa_wavefront_info_t attribute, void* value) const {
+      switch (attribute) {
+      case HSA_WAVEFRONT_INFO_SIZE: {
+        uint32_t* dst = (uint32_t*)value;
+        *dst = size_;
+        return HSA_STATUS_SUCCESS;
+      }
+      default: return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+      }
+      return HSA_STATUS_SUCCESS;
+    }
+
+    uint32_t Size() const {
+      return size_;
+    }
+
+  private:
+    uint32_t size_;
+  };
+
+  // Instruction set a kernel for a CPU agent may be compiled for, named after the widest vector
+  // extension it uses. Each ISA has a single call convention with a single wavefront.
+  class Isa {
+  public:
+    Isa(const char* name, uint32_t vector_bits) : name_(name), wavefront_(vector_bits / 32) {}
+
+    hsa_status_t Get(hsa_isa_info_t attribute, void* value) const {
+      switch (attribute) {
+      case HSA_ISA_INFO_NAME_LENGTH: {
+        uint32_t* dst = (uint32_t*)value;
+        *dst = (uint32_t)name_.size() + 1;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_ISA_INFO_NAME: {
+        char* dst = (char*)value;
+        memcpy(dst, name_.c_str(), name_.size() + 1);
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_ISA_INFO_CALL_CONVENTION_COUNT: {
+        uint32_t* dst = (uint32_t*)value;
+        *dst = 1;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_ISA_INFO_CALL_CONVENTION_INFO_WAVEFRONT_SIZE: {
+        uint32_t* dst = (uint32_t*)value;
+        *dst = wavefront_.Size();
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_ISA_INFO_CALL_CONVENTION_INFO_WAVEFRONTS_PER_COMPUTE_UNIT: {
+        uint32_t* dst = (uint32_t*)value;
+        *dst = 1;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_ISA_INFO_MACHINE_MODELS: {
+        bool* dst = (bool*)value;
+        dst[HSA_MACHINE_MODEL_SMALL] = false;
+        dst[HSA_MACHINE_MODEL_LARGE] = true;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_ISA_INFO_PROFILES: {
+        bool* dst = (bool*)value;
+        dst[HSA_PROFILE_BASE] = false;
+        dst[HSA_PROFILE_FULL] = true;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_ISA_INFO_DEFAULT_FLOAT_ROUNDING_MODES:
+      case HSA_ISA_INFO_BASE_PROFILE_DEFAULT_FLOAT_ROUNDING_MODES: {
+        // the rounding mode is part of the instructions, not a default of the agent
+        bool* dst = (bool*)value;
+        dst[HSA_DEFAULT_FLOAT_ROUNDING_MODE_DEFAULT] = false;
+        dst[HSA_DEFAULT_FLOAT_ROUNDING_MODE_ZERO] = true;
+        dst[HSA_DEFAULT_FLOAT_ROUNDING_MODE_NEAR] = true;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_ISA_INFO_FAST_F16_OPERATION: {
+        bool* dst = (bool*)value;
+        *dst = false;
+        return HSA_STATUS_SUCCESS;
+      }
+      // The work-items of a workgroup run as a loop on one thread, so the limits are those of
+      // the dispatch packet fields.
+      case HSA_ISA_INFO_WORKGROUP_MAX_DIM: {
+        uint16_t* dst = (uint16_t*)value;
+        dst[0] = dst[1] = dst[2] = UINT16_MAX;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_ISA_INFO_WORKGROUP_MAX_SIZE: {
+        uint32_t* dst = (uint32_t*)value;
+        *dst = UINT32_MAX;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_ISA_INFO_GRID_MAX_DIM: {
+        hsa_dim3_t* dst = (hsa_dim3_t*)value;
+        dst->x = dst->y = dst->z = UINT32_MAX;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_ISA_INFO_GRID_MAX_SIZE: {
+        uint64_t* dst = (uint64_t*)value;
+        *dst = UINT64_MAX;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_ISA_INFO_FBARRIER_MAX_SIZE: {
+        uint32_t* dst = (uint32_t*)value;
+        *dst = 32;
+        return HSA_STATUS_SUCCESS;
+      }
+      default: return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+      }
+      return HSA_STATUS_SUCCESS;
+    }
+
+    const std::string& Name() const {
+      return name_;
+    }
+
+    const Wavefront* GetWavefront() const {
+      return &wavefront_;
+    }
+
+  private:
+    std::string name_;
+    Wavefront wavefront_;
+  };
+
+  // Every ISA the runtime knows, widest vectors first. The scalar one runs on any CPU.
+  static const Isa isas_g[] = {
+    Isa("CPU:x86-64-avx512f", 512),
+    Isa("CPU:x86-64-avx2", 256),
+    Isa("CPU:x86-64-sse4.2", 128),
+    Isa("CPU:generic", 32)
+  };
+
+  static const Isa* FindIsa(const char* name) {
+    for (size_t i = 0; i < sizeof(isas_g) / sizeof(isas_g[0]); i++) {
+      if (isas_g[i].Name() == name) {
+        return &isas_g[i];
+      }
+    }
+    return nullptr;
+  }
+
+  // The ISAs the CPUs of this machine execute, widest vectors first, so kernel selection can take
+  // the first one it has code for.
+  static std::vector<const Isa*> DetectIsas() {
+    std::vector<const Isa*> isas;
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+      isas.push_back(FindIsa("CPU:x86-64-avx512f"));
+    }
+    if (__builtin_cpu_supports("avx2")) {
+      isas.push_back(FindIsa("CPU:x86-64-avx2"));
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+      isas.push_back(FindIsa("CPU:x86-64-sse4.2"));
+    }
+#endif
+    isas.push_back(FindIsa("CPU:generic"));
+    return isas;
+  }
+
+  // Owns the storage of every signal. Signals live in chunks of cache-line sized
+  // slots so the handle can name a slot by index instead of by address: the low
+  // 32 bits of a handle hold the slot index, the high 32 bits its generation.
+  // Destroying a signal bumps the generation, so stale handles fail Lookup.
+  // Free slots are recycled through small per-thread caches backed by a global
+  // free list.
+  class SignalPool {
+  public:
+    SignalPool() : num_chunks_(0) {
+      for (uint32_t i = 0; i < kMaxChunks; i++) {
+        chunks_[i].store(nullptr, std::memory_order_relaxed);
+      }
+    }
+
+    ~SignalPool() {
+      // Signal has a trivial destructor, so chunks are released without visiting slots
+      for (uint32_t i = 0; i < num_chunks_; i++) {
+        AlignedFree(chunks_[i].load(std::memory_order_relaxed));
+      }
+    }
+
+    SignalPool(const SignalPool&) = delete;
+    SignalPool& operator=(SignalPool const&) = delete;
+
+    hsa_status_t Create(hsa_signal_value_t initial_value, hsa_signal_t* signal) {
+      ThreadCache& cache = cache_;
+      if (cache.free.empty() && !Refill(cache.free)) {
+        return HSA_STATUS_ERROR_OUT_OF_RESOURCES;
+      }
+      uint32_t index = cache.free.back();
+      cache.free.pop_back();
+      Slot& slot = GetSlot(index);
+      new (&slot.signal) Signal(initial_value);
+      signal->handle = ((uint64_t)slot.generation.load(std::memory_order_relaxed) << 32) | index;
+      return HSA_STATUS_SUCCESS;
+    }
+
+    hsa_status_t Destroy(hsa_signal_t signal) {
+      if (Lookup(signal.handle) == nullptr) {
+        return HSA_STATUS_ERROR_INVALID_SIGNAL;
+      }
+      uint32_t index = (uint32_t)signal.handle;
+      Slot& slot = GetSlot(index);
+      uint32_t generation = (uint32_t)(signal.handle >> 32);
+      uint32_t next = generation + 1;
+      // generation zero is never handed out, which keeps handle zero invalid. Of concurrent
+      // destroys of the same handle, only one frees the slot.
+      if (!slot.generation.compare_exchange_strong(generation, next == 0 ? 1 : next, std::memory_order_relaxed)) {
+        return HSA_STATUS_ERROR_INVALID_SIGNAL;
+      }
+      ThreadCache& cache = cache_;
+      cache.free.push_back(index);
+      if (cache.free.size() > kThreadCacheSize) {
+        Flush(cache.free, kThreadCacheSize / 2);
+      }
+      return HSA_STATUS_SUCCESS;
+    }
+
+    // Returns nullptr if the handle does not name a live signal.
+    Signal* Lookup(uint64_t handle) const {
+      uint32_t index = (uint32_t)handle;
+      uint32_t chunk_index = index / kChunkSlots;
+      if (chunk_index >= kMaxChunks) {
+        return nullptr;
+      }
+      Slot* chunk = chunks_[chunk_index].load(std::memory_order_acquire);
+      if (chunk == nullptr) {
+        return nullptr;
+      }
+      Slot& slot = chunk[index % kChunkSlots];
+      if (slot.generation.load(std::memory_order_relaxed) != (uint32_t)(handle >> 32)) {
+        return nullptr;
+      }
+      return &slot.signal;
+    }
+
+  private:
+    struct alignas(64) Slot {
+      Signal signal;
+      std::atomic<uint32_t> generation;
+    };
+
+    struct ThreadCache {
+      ~ThreadCache();
+      std::vector<uint32_t> free;
+    };
+
+    Slot& GetSlot(uint32_t index) const {
+      return chunks_[index / kChunkSlots].load(std::memory_order_relaxed)[index % kChunkSlots];
+    }
+
+    // Moves up to kThreadCacheSize / 2 free slots into the calling thread's cache,
+    // carving a new chunk if the global list is empty.
+    bool Refill(std::vector<uint32_t>& local) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (free_.empty()) {
+        if (num_chunks_ == kMaxChunks) {
+          return false;
+        }
+        Slot* chunk = (Slot*)AlignedAlloc(kChunkSlots * sizeof(Slot), alignof(Slot));
+        if (chunk == nullptr) {
+          return false;
+        }
+        for (uint32_t i = 0; i < kChunkSlots; i++) {
+          new (&chunk[i]) Slot();
+          chunk[i].generation.store(1, std::memory_order_relaxed);
+        }
+        uint32_t base = num_chunks_ * kChunkSlots;
+        chunks_[num_chunks_++].store(chunk, std::memory_order_release);
+        for (uint32_t i = kChunkSlots; i > 0; i--) {
+          free_.push_back(base + i - 1);
+        }
+      }
+      size_t count = std::min(free_.size(), (size_t)(kThreadCacheSize / 2));
+      local.insert(local.end(), free_.end() - count, free_.end());
+      free_.resize(free_.size() - count);
+      return true;
+    }
+
+    void Flush(std::vector<uint32_t>& local, size_t count) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      free_.insert(free_.end(), local.end() - count, local.end());
+      local.resize(local.size() - count);
+    }
+
+    static const uint32_t kChunkSlots = 4096;
+    static const uint32_t kMaxChunks = 4096;
+    static const size_t kThreadCacheSize = 64;
+
+    static thread_local ThreadCache cache_;
+
+    std::atomic<Slot*> chunks_[kMaxChunks];
+    uint32_t num_chunks_;
+    std::mutex mutex_;
+    std::vector<uint32_t> free_;
+  };
+
+  static SignalPool signal_pool_g;
+
+  thread_local SignalPool::ThreadCache SignalPool::cache_;
+
+  SignalPool::ThreadCache::~ThreadCache() {
+    if (!free.empty()) {
+      signal_pool_g.Flush(free, free.size());
+    }
+  }
+
+  // For the signal operations that cannot return HSA_STATUS_ERROR_INVALID_SIGNAL: an invalid
+  // handle aborts rather than dereferencing a null pointer.
+  static Signal* ToSignal(hsa_signal_t signal) {
+    Signal* sig = signal_pool_g.Lookup(signal.handle);
+    if (sig == nullptr) {
+      std::abort();
+    }
+    return sig;
+  }
+
+  SignalGroup::SignalGroup(uint32_t num_signals, const hsa_signal_t* signals) :
+    signals_(signals, signals + num_signals), links_(num_signals) {
+    for (uint32_t i = 0; i < num_signals; i++) {
+      links_[i].listener = &event_;
+      members_.push_back(ToSignal(signals[i]));
+      members_[i]->AttachListener(&links_[i]);
+    }
+  }
+
+  // Fixed set of worker threads owned by an agent. Run splits a batch of tasks
+  // between the workers and the calling thread, and returns once all of them
+  // have completed. The workers serve one caller at a time: a batch that arrives
+  // while they are busy runs on the calling thread alone rather than waiting, as a
+  // kernel may wait for one dispatched from another queue of the same agent.
+  //
+  // Each participant owns a deque holding a contiguous range of task indices.
+  // The owner pops chunks from the front; once its range is empty it steals the
+  // back half of another participant's range, so skewed batches rebalance.
+  class WorkerPool {
+  public:
+    // The worker threads run on cpus, or anywhere if it is empty
+    explicit WorkerPool(uint32_t num_workers, const std::vector<uint32_t>& cpus = std::vector<uint32_t>()) :
+      start_(0), done_(0), task_(nullptr), chunk_(1), active_(true), cpus_(cpus) {
+      ranges_ = (Range*)AlignedAlloc((num_workers + 1) * sizeof(Range), alignof(Range));
+      for (uint32_t i = 0; i <= num_workers; i++) {
+        new (&ranges_[i]) Range();
+      }
+      for (uint32_t i = 0; i < num_workers; i++) {
+        workers_.push_back(new std::thread(&WorkerPool::Work, this, i + 1));
+      }
+    }
+
+    ~WorkerPool() {
+      active_.store(false, std::memory_order_release);
+      start_.Add(1, std::memory_order_release);
+      for (size_t i = 0; i < workers_.size(); i++) {
+        workers_[i]->join();
+        delete workers_[i];
+      }
+      AlignedFree(ranges_);
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(WorkerPool const&) = delete;
+
+    void Run(uint64_t num_tasks, const std::function<void(uint64_t)>& task) {
+      std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+      if (workers_.empty() || num_tasks == 1 || !lock.try_lock()) {
+        for (uint64_t i = 0; i < num_tasks; i++) {
+          task(i);
+        }
+        return;
+      }
+      task_ = &task;
+      uint64_t participants = NumThreads();
+      // small grids get single-task chunks, large ones amortize the deque operations
+      chunk_ = std::max(num_tasks / (participants * kChunksPerParticipant), (uint64_t)1);
+      for (uint64_t p = 0; p < participants; p++) {
+        ranges_[p].begin = num_tasks * p / participants;
+        ranges_[p].end = num_tasks * (p + 1) / participants;
+      }
+      done_.Store(workers_.size(), std::memory_order_relaxed);
+      // publishes the batch to the workers
+      start_.Add(1, std::memory_order_release);
+      RunShare(0);
+      done_.Wait(std::memory_order_acquire, HSA_SIGNAL_CONDITION_EQ, 0);
+    }
+
+    uint32_t NumThreads() const {
+      return (uint32_t) workers_.size() + 1;
+    }
+
+  private:
+    struct alignas(64) Range {
+      SpinLock lock;
+      uint64_t begin;
+      uint64_t end;
+    };
+
+    // Takes the next chunk from the front of the participant's own range
+    bool Pop(uint32_t participant, uint64_t* begin, uint64_t* end) {
+      Range& range = ranges_[participant];
+      std::lock_guard<SpinLock> lock(range.lock);
+      if (range.begin == range.end) {
+        return false;
+      }
+      *begin = range.begin;
+      *end = std::min(range.begin + chunk_, range.end);
+      range.begin = *end;
+      return true;
+    }
+
+    // Moves the back half of some other participant's range into our own
+    bool Steal(uint32_t participant) {
+      uint32_t participants = NumThreads();
+      for (uint32_t i = 1; i < participants; i++) {
+        Range& victim = ranges_[(participant + i) % participants];
+        uint64_t begin, end;
+        {
+          std::lock_guard<SpinLock> lock(victim.lock);
+          uint64_t size = victim.end - victim.begin;
+          if (size == 0) {
+            continue;
+          }
+          begin = victim.end - (size + 1) / 2;
+          end = victim.end;
+          victim.end = begin;
+        }
+        Range& own = ranges_[participant];
+        std::lock_guard<SpinLock> lock(own.lock);
+        own.begin = begin;
+        own.end = end;
+        return true;
+      }
+      return false;
+    }
+
+    void RunShare(uint32_t participant) {
+      uint64_t begin, end;
+      do {
+        while (Pop(participant, &begin, &end)) {
+          for (uint64_t i = begin; i < end; i++) {
+            (*task_)(i);
+          }
+        }
+      } while (Steal(participant));
+    }
+
+    void Work(uint32_t participant) {
+      PinThread(cpus_);
+      // not start_.Load(): a batch might have been published before this thread started
+      hsa_signal_value_t seen = 0;
+      while (true) {
+        start_.Wait(std::memory_order_acquire, HSA_SIGNAL_CONDITION_NE, seen);
+        if (!active_.load(std::memory_order_acquire)) {
+          return;
+        }
+        seen++;
+        RunShare(participant);
+        done_.Subtract(1, std::memory_order_release);
+      }
+    }
+
+    static const uint64_t kChunksPerParticipant = 16;
+
+    std::vector<std::thread*> workers_;
+    Range* ranges_;
+    std::mutex mutex_;
+    Signal start_;
+    Signal done_;
+    const std::function<void(uint64_t)>* task_;
+    uint64_t chunk_;
+    std::atomic<bool> active_;
+    std::vector<uint32_t> cpus_;
+  };
+
+  static WorkerPool* GetWorkerPool(hsa_agent_t agent);
+
+  class QueueScheduler;
+  static QueueScheduler* GetQueueScheduler(hsa_agent_t agent);
+
+  // Ring buffer of kernel arguments carved from the kernarg region of the agent. Every allocation
+  // is tagged with the ID of the packet that uses it, and is reclaimed once the packet processor
+  // has retired that packet (the read index moved past it). Allocations are reclaimed in the
+  // order they were made, so a packet that is retired late holds back the ones allocated after it.
+  class KernargArena {
+  public:
+    // Room for slots allocations of up to bytes_per_slot bytes each, not counting the record that
+    // precedes every allocation.
+    KernargArena(hsa_agent_t agent, size_t slots, size_t bytes_per_slot, size_t alignment) :
+      agent_(agent), buffer_(nullptr), base_(nullptr), alignment_(alignment), head_(0), tail_(0) {
+      // every offset in the ring is a multiple of the alignment, and so is the capacity
+      capacity_ = slots * (RoundUp(sizeof(Record), alignment_) + RoundUp(bytes_per_slot, alignment_));
+    }
+
+    ~KernargArena();
+
+    KernargArena(const KernargArena&) = delete;
+    KernargArena& operator=(KernargArena const&) = delete;
+
+    // Waits until there is room for size bytes. Fails if size exceeds the capacity of the arena or
+    // the backing memory cannot be allocated.
+    hsa_status_t Alloc(uint64_t packet_id, size_t size, const std::atomic<uint64_t>& read_index, void** ptr) {
+      const size_t header = RoundUp(sizeof(Record), alignment_);
+      const size_t length = header + RoundUp(size == 0 ? 1 : size, alignment_);
+      if (length > capacity_) {
+        return HSA_STATUS_ERROR_OUT_OF_RESOURCES;
+      }
+      while (true) {
+        {
+          std::lock_guard<SpinLock> lock(lock_);
+          if (base_ == nullptr && !Init()) {
+            return HSA_STATUS_ERROR_OUT_OF_RESOURCES;
+          }
+          Reclaim(read_index.load(std::memory_order_acquire));
+          size_t offset = head_ % capacity_;
+          // allocations never wrap around: the end of the ring is skipped if it is too short
+          size_t padding = (offset + length > capacity_) ? capacity_ - offset : 0;
+          if (head_ + padding + length - tail_ <= capacity_) {
+            if (padding != 0) {
+              // reclaimed together with the allocation that follows it
+              new (base_ + offset) Record{ packet_id, padding };
+              head_ += padding;
+              offset = 0;
+            }
+            new (base_ + offset) Record{ packet_id, length };
+            head_ += length;
+            *ptr = base_ + offset + header;
+            return HSA_STATUS_SUCCESS;
+          }
+        }
+        // the arena is full until the packet processor retires more packets
+        std::this_thread::yield();
+      }
+    }
+
+  private:
+    struct Record {
+      uint64_t packet_id;
+      size_t length;
+    };
+
+    static size_t RoundUp(size_t value, size_t alignment) {
+      return (value + alignment - 1) & ~(alignment - 1);
+    }
+
+    bool Init();
+
+    void Reclaim(uint64_t read_index) {
+      while (tail_ != head_) {
+        Record* record = (Record*)(base_ + tail_ % capacity_);
+        if (record->packet_id >= read_index) {
+          break;
+        }
+        tail_ += record->length;
+      }
+    }
+
+    hsa_agent_t agent_;
+    // memory obtained from the kernarg region, and its first aligned byte
+    void* buffer_;
+    uint8_t* base_;
+    size_t capacity_;
+    size_t alignment_;
+    SpinLock lock_;
+    // offsets of the next allocation and of the oldest live one; they only grow
+    uint64_t head_;
+    uint64_t tail_;
+  };
+
+  // Producers and the packet processor write to different cache lines: the write index, the read
+  // index and the scheduling state are each kept on a line of their own, and the doorbell lives
+  // in its signal pool slot.
+  struct alignas(64) Queue {
+    Queue(hsa_agent_t agent,
+      uint32_t size,
+      hsa_queue_type_t type,
+      queue_callback_t callback,
+      void *data) {
+      packets_ = AllocateRing(size * sizeof(packet_t), &ring_mapped_);
+      memset(packets_, 0, size * sizeof(packet_t));
+      dispatches_ = new Dispatch[size];
+      read_index_ = 0;
+      write_index_ = 0;
+      agent_ = agent;
+      callback_ = callback;
+      callback_data_ = data;
+
+      q_.type = type;
+      hsa_agent_get_info(agent, HSA_AGENT_INFO_FEATURE, &(q_.features));
+      q_.base_address = packets_;
+      // we need to set the initial value to some negative number, otherwise the packet processor (or the
+      // application code waiting for the signal to become zero) will get confused between unitialized
+      // doorbells and doorbells rang with ID zero
+      signal_pool_g.Create(-1, &q_.doorbell_signal);
+      doorbell_ = ToSignal(q_.doorbell_signal);
+
+      q_.size = size;
+      q_.id = GetUniqueId();
+
+      size_t alignment = kDefaultKernargAlignment;
+      const char* kernarg_alignment = getenv("HSA_KERNARG_ALIGNMENT");
+      if (kernarg_alignment != nullptr) {
+        alignment = strtoul(kernarg_alignment, nullptr, 10);
+        // a power of two, and enough for the allocation records
+        while (alignment & (alignment - 1)) {
+          alignment &= alignment - 1;
+        }
+        alignment = alignment < kDefaultKernargAlignment ? kDefaultKernargAlignment : alignment;
+      }
+      size_t kernarg_bytes = kDefaultKernargBytesPerPacket;
+      const char* bytes_per_packet = getenv("HSA_KERNARG_BYTES_PER_PACKET");
+      if (bytes_per_packet != nullptr) {
+        kernarg_bytes = strtoul(bytes_per_packet, nullptr, 10);
+      }
+      // the memory is only allocated once the first kernarg is
+      kernargs_ = new KernargArena(agent, size, kernarg_bytes, alignment);
+
+      state_ = kIdle;
+      ok_ = true;
+      num_deps_attached_ = 0;
+      scheduler_ = nullptr;
+      listener_.queue_ = this;
+      profiling_ = false;
+      times_ = nullptr;
+      timed_packet_ = kNoPacket;
+    }
+
+    // Registers a kernel dispatch queue with the packet processor threads of its agent.
+    // Returns false if the agent cannot take more queues.
+    bool Start();
+
+    ~Queue() {
+      if (scheduler_ != nullptr) {
+        Stop();
+      }
+      delete kernargs_;
+      FreeRing(packets_, ring_mapped_);
+      delete[] dispatches_;
+      delete[] times_.load(std::memory_order_relaxed);
+      signal_pool_g.Destroy(q_.doorbell_signal);
+    }
+
+    Queue(const Queue& q) = delete;
+    Queue& operator=(Queue const&) = delete;
+
+    // new only honors alignof(std::max_align_t) before C++17
+    static void* operator new(size_t size) {
+      void* ptr = AlignedAlloc(size, alignof(Queue));
+      if (ptr == nullptr) {
+        throw std::bad_alloc();
+      }
+      return ptr;
+    }
+
+    static void operator delete(void* ptr) {
+      AlignedFree(ptr);
+    }
+
+    // The ring is page aligned, so no packet straddles two cache lines or two pages. With
+    // HSA_QUEUE_HUGE_PAGES=1 it is mapped on huge pages instead (rounding its size up to a whole
+    // number of huge pages); *mapped receives the mapped size, or zero if the ring comes from
+    // AlignedAlloc.
+    static packet_t* AllocateRing(size_t size, size_t* mapped) {
+      *mapped = 0;
+#if defined(__linux__) && defined(MAP_HUGETLB)
+      const char* huge_pages = getenv("HSA_QUEUE_HUGE_PAGES");
+      if (huge_pages != nullptr && strtoul(huge_pages, nullptr, 10) != 0) {
+        size_t length = (size + kHugePageSize - 1) & ~(kHugePageSize - 1);
+        void* ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED) {
+          *mapped = length;
+          return (packet_t*)ptr;
+        }
+        // no huge pages reserved: fall back to regular pages
+      }
+#endif
+      size_t page = PageSize();
+      packet_t* ring = (packet_t*)AlignedAlloc((size + page - 1) & ~(page - 1), page);
+      if (ring == nullptr) {
+        throw std::bad_alloc();
+      }
+      return ring;
+    }
+
+    static void FreeRing(packet_t* ring, size_t mapped) {
+#if defined(__linux__)
+      if (mapped != 0) {
+        munmap(ring, mapped);
+        return;
+      }
+#endif
+      AlignedFree(ring);
+    }
+
+    static bool HasFence(uint16_t fence) {
+      return fence == HSA_FENCE_SCOPE_AGENT || fence == HSA_FENCE_SCOPE_SYSTEM;
+    }
+
+    static void DecrementCompletionSignal(packet_t& packet) {
+      if (packet.completion_signal.handle != 0) {
+        hsa::Signal* sig = ToSignal(packet.completion_signal);
+        sig->Subtract(1, std::memory_order_release);
+      }
+    }
+
+    // Record of the packet in a ring slot, kept while profiling is enabled. id is published last,
+    // once the packet completed; readers check it again after copying the times, since the
+    // processor reuses the slot a lap later.
+    struct PacketTimes {
+      std::atomic<uint64_t> id;
+      std::atomic<uint64_t> completion_signal;
+      std::atomic<uint64_t> ready;
+      std::atomic<uint64_t> start;
+      std::atomic<uint64_t> end;
+      // last doorbell ring with the ID of a packet in this slot, written by the producers
+      std::atomic<uint64_t> rung_id;
+      std::atomic<uint64_t> rung;
+    };
+
+    // Kernel dispatch packet being executed as part of a batch of independent packets.
+    struct Dispatch {
+      // Returns false if the packet format is invalid
+      bool Init(hsa_kernel_dispatch_packet_t* dispatch_packet, uint64_t first_workgroup) {
+        packet = dispatch_packet;
+        uint32_t dims = get_field(packet->setup, HSA_KERNEL_DISPATCH_PACKET_SETUP_DIMENSIONS, HSA_KERNEL_DISPATCH_PACKET_SETUP_WIDTH_DIMENSIONS);
+        grid[0] = packet->grid_size_x;
+        grid[1] = packet->grid_size_y;
+        grid[2] = packet->grid_size_z;
+        wg[0] = packet->workgroup_size_x;
+        wg[1] = packet->workgroup_size_y;
+        wg[2] = packet->workgroup_size_z;
+        bool valid = dims >= 1 && dims <= 3;
+        for (int i = 0; valid && i < 3; i++) {
+          valid = grid[i] != 0 && wg[i] != 0;
+        }
+        if (!valid) {
+          return false;
+        }
+        // other checks...
+
+        for (int i = 0; i < 3; i++) {
+          count[i] = (grid[i] + wg[i] - 1) / wg[i];
+        }
+        first = first_workgroup;
+        num_workgroups = (uint64_t)count[0] * count[1] * count[2];
+        remaining.store(num_workgroups, std::memory_order_relaxed);
+        return true;
+      }
+
+      void Execute(uint64_t index) const {
+        workgroup_t workgroup;
+        workgroup.id[0] = (uint32_t)(index % count[0]);
+        workgroup.id[1] = (uint32_t)(index / count[0] % count[1]);
+        workgroup.id[2] = (uint32_t)(index / count[0] / count[1]);
+        for (int i = 0; i < 3; i++) {
+          workgroup.begin[i] = workgroup.id[i] * wg[i];
+          workgroup.end[i] = std::min(workgroup.begin[i] + wg[i], grid[i]);
+        }
+        dispatch_t func = (dispatch_t)packet->kernel_object;
+        func(packet->kernarg_address, &workgroup);
+      }
+
+      hsa_kernel_dispatch_packet_t* packet;
+      uint32_t grid[3];
+      uint32_t wg[3];
+      uint32_t count[3];
+      uint64_t first;
+      uint64_t num_workgroups;
+      std::atomic<uint64_t> remaining;
+      // only set while profiling
+      uint64_t id;
+      PacketTimes* times;
+    };
+
+    static Dispatch* FindDispatch(Dispatch* dispatches, uint64_t num_dispatches, uint64_t index) {
+      return std::upper_bound(dispatches, dispatches + num_dispatches, index,
+        [](uint64_t i, const Dispatch& d) { return i < d.first; }) - 1;
+    }
+
+    // Executes the kernel dispatch packet at read_index together with the packets that follow
+    // it, as long as their headers are valid and their barrier bit is clear. The workgroups of
+    // all those packets go to the worker pool as one batch, so independent kernels overlap;
+    // each packet completes as soon as its own last workgroup finishes. A packet with the
+    // barrier bit set always starts a new batch, i.e. only after all preceding packets completed.
+    bool ProcessDispatches(uint64_t read_index) {
+      uint64_t num_dispatches = 0;
+      uint64_t num_workgroups = 0;
+      while (num_dispatches < q_.size) {
+        packet_t* packet = packets_ + (read_index + num_dispatches) % q_.size;
+        if (LoadPacketType(packet) != HSA_PACKET_TYPE_KERNEL_DISPATCH) {
+          break;
+        }
+        if (num_dispatches > 0 && get_field(packet->header, HSA_PACKET_HEADER_BARRIER, HSA_PACKET_HEADER_WIDTH_BARRIER)) {
+          break;
+        }
+        Dispatch& dispatch = dispatches_[num_dispatches];
+        if (!dispatch.Init((hsa_kernel_dispatch_packet_t*)packet, num_workgroups)) {
+          if (num_dispatches > 0) {
+            // the invalid packet is reported once the preceding ones have completed
+            break;
+          }
+          if (callback_) {
+            callback_(HSA_STATUS_ERROR_INVALID_PACKET_FORMAT, &q_, callback_data_);
+          }
+          return false;
+        }
+        num_workgroups += dispatch.num_workgroups;
+        num_dispatches++;
+      }
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+
+      Dispatch* dispatches = dispatches_;
+      PacketTimes* times = ProfilingTimes();
+      if (times == nullptr) {
+        workers_->Run(num_workgroups, [dispatches, num_dispatches](uint64_t index) {
+          Dispatch* dispatch = FindDispatch(dispatches, num_dispatches, index);
+          dispatch->Execute(index - dispatch->first);
+          if (dispatch->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            std::atomic_thread_fence(std::memory_order_release);
+            DecrementCompletionSignal(*(packet_t*)dispatch->packet);
+          }
+        });
+      } else {
+        // a separate loop, so that queues without profiling do not test for it per workgroup
+        uint64_t now = timestamp_g.Now();
+        for (uint64_t i = 0; i < num_dispatches; i++) {
+          dispatches[i].id = read_index + i;
+          dispatches[i].times = BeginTimes(times, read_index + i, (packet_t*)dispatches[i].packet, now);
+        }
+        workers_->Run(num_workgroups, [dispatches, num_dispatches](uint64_t index) {
+          Dispatch* dispatch = FindDispatch(dispatches, num_dispatches, index);
+          PacketTimes* t = dispatch->times;
+          if (t->start.load(std::memory_order_relaxed) == 0) {
+            uint64_t unset = 0;
+            t->start.compare_exchange_strong(unset, timestamp_g.Now(), std::memory_order_relaxed);
+          }
+          dispatch->Execute(index - dispatch->first);
+          if (dispatch->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            EndTimes(t, dispatch->id);
+            std::atomic_thread_fence(std::memory_order_release);
+            DecrementCompletionSignal(*(packet_t*)dispatch->packet);
+          }
+        });
+      }
+
+      for (uint64_t i = 0; i < num_dispatches; i++) {
+        InvalidatePacket(packets_ + (read_index + i) % q_.size);
+      }
+      read_index_.store(read_index + num_dispatches, std::memory_order_release);
+      return true;
+    }
+
+    // Barrier-AND completes once all the dependencies are zero, barrier-OR once any of them is.
+    // The processor thread never waits for the dependencies: if the condition does not hold, the
+    // queue is attached as a listener to all of them and the thread moves on to other queues. Any
+    // update of a dependency marks the queue ready again. Returns false if the barrier is pending.
+    bool ProcessBarrier(packet_t* packet, bool any, PacketTimes* times, uint64_t packet_id) {
+      // barrier-AND and barrier-OR packets share the same layout
+      hsa_barrier_and_packet_t& barrier = *(hsa_barrier_and_packet_t*)packet;
+      Signal* deps[5];
+      int num_deps = 0;
+      for (int i = 0; i < 5; i++) {
+        if (barrier.dep_signal[i].handle != 0) {
+          deps[num_deps++] = ToSignal(barrier.dep_signal[i]);
+        }
+      }
+      auto satisfied = [&]() {
+        for (int i = 0; i < num_deps; i++) {
+          bool done = deps[i]->Load(std::memory_order_acquire) == 0;
+          if (done == any) {
+            return any;
+          }
+        }
+        return !any || num_deps == 0;
+      };
+      if (!satisfied()) {
+        if (num_deps_attached_ == 0) {
+          for (int i = 0; i < num_deps; i++) {
+            dep_links_[i].listener = &listener_;
+            deps_attached_[i] = deps[i];
+            deps[i]->AttachListener(&dep_links_[i]);
+          }
+          num_deps_attached_ = num_deps;
+        }
+        // a dependency updated before the listener was attached did not notify us
+        if (!satisfied()) {
+          return false;
+        }
+      }
+      DetachDependencies();
+      if (times != nullptr) {
+        EndTimes(times, packet_id);
+      }
+      std::atomic_thread_fence(std::memory_order_release);
+      DecrementCompletionSignal(*packet);
+      return true;
+    }
+
+    void DetachDependencies() {
+      for (int i = 0; i < num_deps_attached_; i++) {
+        deps_attached_[i]->DetachListener(&dep_links_[i]);
+      }
+      num_deps_attached_ = 0;
+    }
+
+    static void clear_field(uint16_t* header, unsigned int start, unsigned int width) {
+      *header &= ~(((1 << width) - 1) << start);
+    }
+
+    static unsigned int get_field(uint16_t header, unsigned int start, unsigned int width) {
+      return (header >> start) & ((1 << width) - 1);
+    }
+
+    static void set_field(uint16_t* header, unsigned int start, unsigned int width, unsigned int value) {
+      clear_field(header, start, width);
+      *header |= (value << start);
+    }
+
+    static hsa_packet_type_t LoadPacketType(packet_t* packet) {
+      uint16_t header = reinterpret_cast<std::atomic<uint16_t>*>(&packet->header)->load(std::memory_order_acquire);
+      return (hsa_packet_type_t) get_field(header, HSA_PACKET_HEADER_TYPE, HSA_PACKET_HEADER_WIDTH_TYPE);
+    }
+
+    static void InvalidatePacket(packet_t* packet) {
+      uint16_t header = packet->header;
+      set_field(&header, HSA_PACKET_HEADER_TYPE, HSA_PACKET_HEADER_WIDTH_TYPE, HSA_PACKET_TYPE_INVALID);
+      reinterpret_cast<std::atomic<uint16_t>*>(&packet->header)->store(header, std::memory_order_release);
+    }
+
+    // Processes packets until the queue is empty, the packet at the head is a barrier whose
+    // dependencies are not satisfied yet, or kQuantum packets have been retired. Returns true
+    // if the queue has more work and should be rescheduled right away.
+    bool Service() {
+      uint64_t read_index = read_index_.load(std::memory_order_relaxed);
+      const uint64_t end = read_index + kQuantum;
+      while (ok_ && read_index < end) {
+        packet_t* packet = packets_ + read_index % q_.size;
+        hsa_packet_type_t type = LoadPacketType(packet);
+        if (type <= HSA_PACKET_TYPE_INVALID) {
+          return false;
+        }
+        if (type == HSA_PACKET_TYPE_KERNEL_DISPATCH) {
+          // retires a whole batch of packets
+          ok_ = ProcessDispatches(read_index);
+          read_index = read_index_.load(std::memory_order_relaxed);
+          continue;
+        } else if (type == HSA_PACKET_TYPE_BARRIER_AND || type == HSA_PACKET_TYPE_BARRIER_OR) {
+          PacketTimes* times = ProfilingTimes();
+          PacketTimes* t = nullptr;
+          if (times != nullptr) {
+            // a pending barrier is examined again on later turns; it started on the first one
+            if (timed_packet_ != read_index) {
+              uint64_t now = timestamp_g.Now();
+              BeginTimes(times, read_index, packet, now)->start.store(now, std::memory_order_relaxed);
+              timed_packet_ = read_index;
+            }
+            t = &times[read_index % q_.size];
+          }
+          if (!ProcessBarrier(packet, type == HSA_PACKET_TYPE_BARRIER_OR, t, read_index)) {
+            return false;
+          }
+        } else {
+          // packet format invalid (including agent dispatch)
+          printf("Unknown type: %u\n", type);
+          std::abort();
+        }
+        InvalidatePacket(packet);
+        read_index_.store(++read_index, std::memory_order_release);
+      }
+      return ok_;
+    }
+
+    uint64_t LoadReadIndex(std::memory_order order) const {
+      return read_index_.load(order);
+    }
+
+    void StoreReadIndex(uint64_t value, std::memory_order order) {
+      if (!AgentDispatchQueue()) {
+        std::abort();
+      }
+      read_index_.store(value, order);
+    }
+
+    uint64_t LoadWriteIndex(std::memory_order order) const {
+      return write_index_.load(order);
+    }
+
+    void StoreWriteIndex(uint64_t value, std::memory_order order) {
+      write_index_.store(value, order);
+    }
+
+    uint64_t CasWriteIndex(uint64_t expected, uint64_t value, std::memory_order order) {
+      write_index_.compare_exchange_strong(expected, value, order);
+      return expected;
+    }
+
+    uint64_t AddWriteIndex(uint64_t value, std::memory_order order) {
+      return write_index_.fetch_add(value, order);
+    }
+
+    hsa_status_t AllocKernarg(uint64_t packet_id, size_t size, void** ptr) {
+      return kernargs_->Alloc(packet_id, size, read_index_, ptr);
+    }
+
+    // Packets processed while profiling is enabled get their times recorded. The records are
+    // only allocated the first time profiling is enabled.
+    void SetProfiling(bool enabled) {
+      if (enabled && times_.load(std::memory_order_acquire) == nullptr) {
+        PacketTimes* times = new PacketTimes[q_.size];
+        for (uint32_t i = 0; i < q_.size; i++) {
+          times[i].id.store(kNoPacket, std::memory_order_relaxed);
+          times[i].rung_id.store(kNoPacket, std::memory_order_relaxed);
+        }
+        PacketTimes* expected = nullptr;
+        if (!times_.compare_exchange_strong(expected, times, std::memory_order_acq_rel)) {
+          delete[] times;
+        }
+      }
+      profiling_.store(enabled, std::memory_order_release);
+    }
+
+    // Returns false if the packet did not complete while profiling was enabled, or its slot has
+    // been reused by a later packet since.
+    bool GetTimes(uint64_t packet_id, dispatch_time_t* time) const {
+      PacketTimes* times = times_.load(std::memory_order_acquire);
+      if (times == nullptr || packet_id == kNoPacket) {
+        return false;
+      }
+      const PacketTimes& t = times[packet_id % q_.size];
+      if (t.id.load(std::memory_order_acquire) != packet_id) {
+        return false;
+      }
+      time->ready = t.ready.load(std::memory_order_relaxed);
+      time->start = t.start.load(std::memory_order_relaxed);
+      time->end = t.end.load(std::memory_order_relaxed);
+      // pairs with the fence in BeginTimes
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return t.id.load(std::memory_order_relaxed) == packet_id;
+    }
+
+    // Times of the most recent recorded packet with the given completion signal
+    bool GetTimes(hsa_signal_t completion_signal, dispatch_time_t* time) const {
+      PacketTimes* times = times_.load(std::memory_order_acquire);
+      if (times == nullptr) {
+        return false;
+      }
+      uint64_t latest = kNoPacket;
+      for (uint32_t i = 0; i < q_.size; i++) {
+        uint64_t id = times[i].id.load(std::memory_order_acquire);
+        if (id != kNoPacket && times[i].completion_signal.load(std::memory_order_relaxed) == completion_signal.handle &&
+          (latest == kNoPacket || id > latest)) {
+          latest = id;
+        }
+      }
+      return GetTimes(latest, time);
     }
 
     bool AgentDispatchQueue() { return static_cast<bool>(q_.features & HSA_AGENT_FEATURE_AGENT_DISPATCH); }
 
-    static uint32_t GetUniqueId() {
-      static uint32_t curr = 0; // VS does not support magic static
-      return curr++;
+    static uint32_t GetUniqueId() {
+      static uint32_t curr = 0; // VS does not support magic static
+      return curr++;
+    }
+
+    // Marks the queue ready whenever the doorbell or a dependency of the pending barrier changes.
+    // Kept out of Queue itself so that q_ stays at offset zero.
+    struct Listener : public SignalListener {
+      virtual void Notify();
+      Queue* queue_;
+    };
+
+    void Stop();
+
+    PacketTimes* ProfilingTimes() const {
+      return profiling_.load(std::memory_order_acquire) ? times_.load(std::memory_order_relaxed) : nullptr;
+    }
+
+    // Called on the producer thread that rang the doorbell. Notifications caused by barrier
+    // dependencies find the ring of the current doorbell value already recorded.
+    void RecordRing() {
+      hsa_signal_value_t value = doorbell_->Load(std::memory_order_relaxed);
+      if (value < 0) {
+        return;
+      }
+      PacketTimes& t = times_.load(std::memory_order_relaxed)[(uint64_t)value % q_.size];
+      if (t.rung_id.load(std::memory_order_relaxed) != (uint64_t)value) {
+        t.rung.store(timestamp_g.Now(), std::memory_order_relaxed);
+        t.rung_id.store((uint64_t)value, std::memory_order_release);
+      }
+    }
+
+    // Starts the record of a packet the processor found valid at now. Producers make the header
+    // valid before ringing the doorbell, so the packet was ready at the first ring with its ID or
+    // a later one; if the ring went unrecorded, the time the processor saw the packet is used.
+    PacketTimes* BeginTimes(PacketTimes* times, uint64_t packet_id, const packet_t* packet, uint64_t now) {
+      uint64_t ready = now;
+      uint64_t write_index = write_index_.load(std::memory_order_relaxed);
+      for (uint64_t id = packet_id; id < write_index && id < packet_id + q_.size; id++) {
+        const PacketTimes& slot = times[id % q_.size];
+        if (slot.rung_id.load(std::memory_order_acquire) == id) {
+          ready = std::min(ready, slot.rung.load(std::memory_order_relaxed));
+          break;
+        }
+      }
+      PacketTimes& t = times[packet_id % q_.size];
+      t.id.store(kNoPacket, std::memory_order_relaxed);
+      // readers that see any of the stores below also see the record invalidated
+      std::atomic_thread_fence(std::memory_order_release);
+      t.completion_signal.store(packet->completion_signal.handle, std::memory_order_relaxed);
+      t.ready.store(ready, std::memory_order_relaxed);
+      t.start.store(0, std::memory_order_relaxed);
+      return &t;
+    }
+
+    // Publishes the record; called right before the completion signal is decremented, so the
+    // times can be read as soon as the signal is observed.
+    static void EndTimes(PacketTimes* t, uint64_t packet_id) {
+      t->end.store(timestamp_g.Now(), std::memory_order_relaxed);
+      t->id.store(packet_id, std::memory_order_release);
+    }
+
+    hsa_queue_t q_;
+
+    // written by the producers
+    alignas(64) std::atomic<uint64_t> write_index_;
+    // written by the packet processor
+    alignas(64) std::atomic<uint64_t> read_index_;
+    // written by both on every doorbell ring and every turn of the processor; see QueueScheduler
+    alignas(64) std::atomic<uint32_t> state_;
+
+    // set by the application, read by the producers and the packet processor
+    alignas(64) std::atomic<bool> profiling_;
+    std::atomic<PacketTimes*> times_;
+
+    // from here on, only written by the packet processor or when the queue is created
+    alignas(64) packet_t *packets_;
+    size_t ring_mapped_;
+    Dispatch* dispatches_;
+    KernargArena* kernargs_;
+    Signal* doorbell_;
+    Listener listener_;
+    SignalListenerLink doorbell_link_;
+    SignalListenerLink dep_links_[5];
+    Signal* deps_attached_[5];
+    int num_deps_attached_;
+    queue_callback_t callback_;
+    void* callback_data_;
+    WorkerPool* workers_;
+    QueueScheduler* scheduler_;
+    uint32_t slot_;
+    // false once the queue has reported an error; no more packets are processed
+    bool ok_;
+    // packet whose times are being recorded, for barriers that take several turns
+    uint64_t timed_packet_;
+    hsa_agent_t agent_;
+
+    static const uint32_t kIdle = 0;
+    static const uint32_t kScheduled = 1;
+    static const uint32_t kNotified = 2;
+
+    static const uint64_t kNoPacket = UINT64_MAX;
+
+    // packets retired per turn before the processor thread moves on to the next ready queue
+    static const uint64_t kQuantum = 64;
+
+    // kernarg memory reserved per packet slot, overridden by HSA_KERNARG_BYTES_PER_PACKET
+    static const size_t kDefaultKernargBytesPerPacket = 4096;
+    // overridden by HSA_KERNARG_ALIGNMENT
+    static const size_t kDefaultKernargAlignment = 16;
+  };
+
+  // Packet processor threads shared by all the kernel dispatch queues of an agent, so that the
+  // number of threads does not grow with the number of queues. A queue is flagged in the ready
+  // bitmap whenever its doorbell is rung (or a dependency of its pending barrier changes), and
+  // the processor threads claim ready queues in round-robin order.
+  //
+  // Queue::state_ guarantees that at most one thread services a queue at any time: the bit of a
+  // queue is only set by whoever moves the state out of kIdle, and the thread that services the
+  // queue either returns it to kIdle or, if it was notified in the meantime, sets the bit again.
+  class QueueScheduler {
+  public:
+    // The processor threads run on cpus, or anywhere if it is empty
+    QueueScheduler(uint32_t num_threads, const std::vector<uint32_t>& cpus = std::vector<uint32_t>()) :
+      num_queues_(0), active_(true), cpus_(cpus) {
+      for (uint32_t i = 0; i < kMaxQueues / 64; i++) {
+        ready_[i].store(0, std::memory_order_relaxed);
+      }
+      for (uint32_t i = 0; i < kMaxQueues; i++) {
+        queues_[i] = nullptr;
+      }
+      idle_spin_ns_ = kDefaultIdleSpinNs;
+      const char* idle_spin = getenv("HSA_QUEUE_IDLE_SPIN_NS");
+      if (idle_spin != nullptr) {
+        idle_spin_ns_ = strtoull(idle_spin, nullptr, 10);
+      }
+      for (uint32_t i = 0; i < num_threads; i++) {
+        threads_.push_back(new std::thread(&QueueScheduler::Go, this));
+      }
+    }
+
+    ~QueueScheduler() {
+      active_.store(false, std::memory_order_seq_cst);
+      event_.Notify();
+      for (size_t i = 0; i < threads_.size(); i++) {
+        threads_[i]->join();
+        delete threads_[i];
+      }
+    }
+
+    QueueScheduler(const QueueScheduler&) = delete;
+    QueueScheduler& operator=(QueueScheduler const&) = delete;
+
+    bool Register(Queue* queue) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (num_queues_ == kMaxQueues) {
+        return false;
+      }
+      uint32_t slot = 0;
+      while (queues_[slot] != nullptr) {
+        slot++;
+      }
+      queues_[slot] = queue;
+      queue->slot_ = slot;
+      num_queues_++;
+      return true;
+    }
+
+    // precondition: the caller owns the queue (its state is not kIdle), so its bit is clear
+    void Unregister(Queue* queue) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queues_[queue->slot_] = nullptr;
+      num_queues_--;
+    }
+
+    void MarkReady(Queue* queue) {
+      if (queue->state_.fetch_or(Queue::kScheduled | Queue::kNotified, std::memory_order_seq_cst) == Queue::kIdle) {
+        Push(queue->slot_);
+      }
+    }
+
+    static const uint32_t kMaxQueues = 4096;
+
+  private:
+    void Push(uint32_t slot) {
+      ready_[slot / 64].fetch_or(1ull << (slot % 64), std::memory_order_seq_cst);
+      // pairs with the fence in Event::Wait
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      event_.Notify();
+    }
+
+    // Claims the first ready queue at or after cursor, wrapping around.
+    Queue* Pop(uint32_t* cursor) {
+      const uint32_t words = kMaxQueues / 64;
+      for (uint32_t i = 0; i <= words; i++) {
+        uint32_t word = (*cursor / 64 + i) % words;
+        uint64_t bits = ready_[word].load(std::memory_order_relaxed);
+        if (i == 0) {
+          // only bits at or after the cursor on the first pass, the rest once we wrap around
+          bits &= ~0ull << (*cursor % 64);
+        }
+        while (bits != 0) {
+          uint32_t bit = CountTrailingZeros(bits);
+          uint64_t mask = 1ull << bit;
+          if (ready_[word].fetch_and(~mask, std::memory_order_acquire) & mask) {
+            *cursor = word * 64 + bit + 1;
+            return queues_[word * 64 + bit];
+          }
+          bits &= ~mask;
+        }
+      }
+      return nullptr;
+    }
+
+    bool AnyReady() const {
+      for (uint32_t i = 0; i < kMaxQueues / 64; i++) {
+        if (ready_[i].load(std::memory_order_relaxed) != 0) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    static uint32_t CountTrailingZeros(uint64_t bits) {
+#if defined(_MSC_VER)
+      unsigned long index;
+      _BitScanForward64(&index, bits);
+      return index;
+#else
+      return __builtin_ctzll(bits);
+#endif
+    }
+
+    void Go() {
+      PinThread(cpus_);
+      uint32_t cursor = 0;
+      while (true) {
+        Queue* queue = Pop(&cursor);
+        if (queue == nullptr) {
+          if (!active_.load(std::memory_order_acquire)) {
+            return;
+          }
+          // spin for a while before going to sleep, new packets are likely to arrive soon
+          const uint64_t deadline = NowNs() + idle_spin_ns_;
+          while (!AnyReady() && NowNs() < deadline) {
+            for (int i = 0; i < 64; i++) {
+              CpuRelax();
+            }
+          }
+          event_.Wait([&] { return AnyReady() || !active_.load(std::memory_order_acquire); });
+          continue;
+        }
+        queue->state_.store(Queue::kScheduled, std::memory_order_seq_cst);
+        // notifications from here on are picked up by Service or by the check below
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (queue->Service()) {
+          // quantum used up: give the other ready queues a turn first
+          Push(queue->slot_);
+          continue;
+        }
+        uint32_t expected = Queue::kScheduled;
+        if (!queue->state_.compare_exchange_strong(expected, Queue::kIdle, std::memory_order_seq_cst)) {
+          // notified while being serviced
+          Push(queue->slot_);
+        }
+        // the queue might be destroyed from here on
+      }
+    }
+
+    // default time a processor thread spins when no queue is ready before going to sleep,
+    // overridden by HSA_QUEUE_IDLE_SPIN_NS
+    static const uint64_t kDefaultIdleSpinNs = 20000;
+
+    std::atomic<uint64_t> ready_[kMaxQueues / 64];
+    Queue* queues_[kMaxQueues];
+    uint32_t num_queues_;
+    std::mutex mutex_;
+    std::vector<std::thread*> threads_;
+    Event event_;
+    std::atomic<bool> active_;
+    uint64_t idle_spin_ns_;
+    std::vector<uint32_t> cpus_;
+  };
+
+  void Queue::Listener::Notify() {
+    if (queue_->profiling_.load(std::memory_order_acquire)) {
+      queue_->RecordRing();
+    }
+    queue_->scheduler_->MarkReady(queue_);
+  }
+
+  bool Queue::Start() {
+    scheduler_ = GetQueueScheduler(agent_);
+    if (!scheduler_->Register(this)) {
+      scheduler_ = nullptr;
+      return false;
+    }
+    workers_ = GetWorkerPool(agent_);
+    doorbell_link_.listener = &listener_;
+    doorbell_->AttachListener(&doorbell_link_);
+    // packets might have been written before the doorbell listener was attached
+    scheduler_->MarkReady(this);
+    return true;
+  }
+
+  void Queue::Stop() {
+    // take ownership of the queue, waiting for the processor thread currently servicing it
+    uint32_t expected = kIdle;
+    while (!state_.compare_exchange_weak(expected, kScheduled, std::memory_order_acquire)) {
+      expected = kIdle;
+      std::this_thread::yield();
+    }
+    doorbell_->DetachListener(&doorbell_link_);
+    DetachDependencies();
+    scheduler_->Unregister(this);
+  }
+
+
+  class Region {
+  public:
+    virtual void* Alloc(size_t size) = 0;
+
+    virtual void Free(void* ptr) = 0;
+
+    virtual hsa_status_t Get(hsa_region_info_t attribute, void* value) const = 0;
+
+    // NUMA node of the memory
+    virtual uint32_t Node() const = 0;
+
+    // Makes agent the owner of the block at ptr. Blocks of fine-grained regions are accessible
+    // to every agent, so there is nothing to track.
+    virtual hsa_status_t AssignAgent(void* /* ptr */, hsa_agent_t /* agent */, hsa_access_permission_t /* access */) {
+      return HSA_STATUS_SUCCESS;
+    }
+  };
+
+  // Maps the base address of every block returned by hsa_memory_allocate to the region that
+  // allocated it, so that hsa_memory_free can hand the block back to the right allocator.
+  //
+  // A radix tree over the address in 16-byte granules (57-bit addresses, five levels). Lookups
+  // only walk atomic pointers and never take a lock; nodes are created with a CAS and are not
+  // freed before the index itself, so readers never see one go away. Leaves hold one-byte region
+  // IDs instead of pointers to keep them small.
+  class AllocationIndex {
+  public:
+    AllocationIndex() : num_regions_(0) {
+      for (uint32_t i = 0; i < kRootFanout; i++) {
+        root_[i].store(nullptr, std::memory_order_relaxed);
+      }
+      for (uint32_t i = 0; i < kMaxRegions; i++) {
+        regions_[i].store(nullptr, std::memory_order_relaxed);
+      }
+    }
+
+    ~AllocationIndex() {
+      for (uint32_t i = 0; i < kRootFanout; i++) {
+        Destroy(root_[i].load(std::memory_order_relaxed), kInnerLevels);
+      }
+    }
+
+    AllocationIndex(const AllocationIndex&) = delete;
+    AllocationIndex& operator=(AllocationIndex const&) = delete;
+
+    // Fails if ptr is not 16-byte aligned or there is no memory left for the tree.
+    bool Insert(void* ptr, Region* region) {
+      uint8_t id = RegionId(region);
+      std::atomic<uint8_t>* entry = Find(ptr, true);
+      if (id == 0 || entry == nullptr) {
+        return false;
+      }
+      entry->store(id, std::memory_order_release);
+      return true;
+    }
+
+    // Returns the region that allocated ptr, or nullptr if ptr was not returned by Insert.
+    Region* Lookup(void* ptr) {
+      std::atomic<uint8_t>* entry = Find(ptr, false);
+      if (entry == nullptr) {
+        return nullptr;
+      }
+      uint8_t id = entry->load(std::memory_order_acquire);
+      return id == 0 ? nullptr : regions_[id].load(std::memory_order_acquire);
+    }
+
+    // Returns the region that allocated ptr and forgets about the block, or nullptr if ptr was
+    // not returned by Insert (or was removed already).
+    Region* Remove(void* ptr) {
+      std::atomic<uint8_t>* entry = Find(ptr, false);
+      if (entry == nullptr) {
+        return nullptr;
+      }
+      uint8_t id = entry->exchange(0, std::memory_order_acq_rel);
+      return id == 0 ? nullptr : regions_[id].load(std::memory_order_acquire);
+    }
+
+  private:
+    static const uint32_t kGranuleBits = 4;
+    static const uint32_t kLevelBits = 11;
+    static const uint32_t kFanout = 1 << kLevelBits;
+    // levels between the root and the leaves
+    static const uint32_t kInnerLevels = 3;
+    static const uint32_t kRootShift = (kInnerLevels + 1) * kLevelBits;
+    static const uint32_t kRootBits = 57 - kGranuleBits - kRootShift;
+    static const uint32_t kRootFanout = 1 << kRootBits;
+    static const uint32_t kMaxRegions = 256;
+
+    struct Inner {
+      Inner() {
+        for (uint32_t i = 0; i < kFanout; i++) {
+          children[i].store(nullptr, std::memory_order_relaxed);
+        }
+      }
+      std::atomic<void*> children[kFanout];
+    };
+
+    struct Leaf {
+      Leaf() {
+        for (uint32_t i = 0; i < kFanout; i++) {
+          ids[i].store(0, std::memory_order_relaxed);
+        }
+      }
+      std::atomic<uint8_t> ids[kFanout];
+    };
+
+    // Returns the leaf entry of ptr, creating the missing nodes on the way if create is set.
+    std::atomic<uint8_t>* Find(void* ptr, bool create) {
+      uint64_t key = (uint64_t)ptr >> kGranuleBits;
+      if (((uint64_t)ptr & ((1 << kGranuleBits) - 1)) != 0 || (key >> (kRootShift + kRootBits)) != 0) {
+        return nullptr;
+      }
+      std::atomic<void*>* slot = &root_[key >> kRootShift];
+      for (uint32_t level = kInnerLevels; ; level--) {
+        void* node = slot->load(std::memory_order_acquire);
+        if (node == nullptr) {
+          if (!create) {
+            return nullptr;
+          }
+          void* fresh = (level == 0) ? (void*)new (std::nothrow) Leaf() : (void*)new (std::nothrow) Inner();
+          if (fresh == nullptr) {
+            return nullptr;
+          }
+          if (slot->compare_exchange_strong(node, fresh, std::memory_order_acq_rel)) {
+            node = fresh;
+          } else {
+            // another thread created it first; node now holds that one
+            Destroy(fresh, level);
+          }
+        }
+        uint32_t index = (key >> (level * kLevelBits)) & (kFanout - 1);
+        if (level == 0) {
+          return &((Leaf*)node)->ids[index];
+        }
+        slot = &((Inner*)node)->children[index];
+      }
+    }
+
+    static void Destroy(void* node, uint32_t level) {
+      if (node == nullptr) {
+        return;
+      }
+      if (level == 0) {
+        delete (Leaf*)node;
+        return;
+      }
+      Inner* inner = (Inner*)node;
+      for (uint32_t i = 0; i < kFanout; i++) {
+        Destroy(inner->children[i].load(std::memory_order_relaxed), level - 1);
+      }
+      delete inner;
+    }
+
+    // IDs start at one, zero marks a free entry. Returns zero if all the IDs are taken.
+    uint8_t RegionId(Region* region) {
+      uint32_t num_regions = num_regions_.load(std::memory_order_acquire);
+      for (uint32_t id = 1; id <= num_regions; id++) {
+        if (regions_[id].load(std::memory_order_relaxed) == region) {
+          return (uint8_t)id;
+        }
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      num_regions = num_regions_.load(std::memory_order_relaxed);
+      for (uint32_t id = 1; id <= num_regions; id++) {
+        if (regions_[id].load(std::memory_order_relaxed) == region) {
+          return (uint8_t)id;
+        }
+      }
+      if (num_regions + 1 == kMaxRegions) {
+        return 0;
+      }
+      regions_[num_regions + 1].store(region, std::memory_order_release);
+      num_regions_.store(num_regions + 1, std::memory_order_release);
+      return (uint8_t)(num_regions + 1);
+    }
+
+    std::atomic<void*> root_[kRootFanout];
+    std::atomic<Region*> regions_[kMaxRegions];
+    std::atomic<uint32_t> num_regions_;
+    std::mutex mutex_;
+  };
+
+  static AllocationIndex allocation_index_g;
+
+  // Pages pinned by hsa_memory_register. The pinned pages are kept as disjoint, page-aligned
+  // segments in an ordered map (a red-black tree), each counting the registrations that cover
+  // it: overlapping registrations split the segments at their boundaries and share the pages in
+  // the overlap. Pages are locked when first registered. Once no registration covers them they
+  // stay locked in the cache, up to HSA_REGISTRATION_CACHE_BYTES (default 16 MiB) of such pages,
+  // evicting the least recently released first; so a buffer registered over and over again
+  // (the same range as a segment) costs a single lookup and an mlock, but no tree update and no
+  // munlock. The mlock on a hit is needed because the application may have unmapped the pages
+  // and mapped others at the same address since they were released.
+  //
+  // Registrations themselves are tracked by byte range, so only a range that was registered
+  // can be deregistered.
+  class RegistrationCache {
+  public:
+    RegistrationCache() : cached_bytes_(0), clock_(0), limit_(kDefaultLimit) {
+      const char* limit = getenv("HSA_REGISTRATION_CACHE_BYTES");
+      if (limit != nullptr) {
+        limit_ = (size_t)strtoull(limit, nullptr, 10);
+      }
+    }
+
+    ~RegistrationCache() {
+      for (std::map<uintptr_t, Segment>::iterator it = segments_.begin(); it != segments_.end(); ++it) {
+        Unpin(it->first, it->second.end);
+      }
+    }
+
+    RegistrationCache(const RegistrationCache&) = delete;
+    RegistrationCache& operator=(RegistrationCache const&) = delete;
+
+    hsa_status_t Register(void* ptr, size_t size) {
+      uintptr_t start, end;
+      PageRange(ptr, size, &start, &end);
+      std::lock_guard<std::mutex> lock(mutex_);
+      std::map<uintptr_t, Segment>::iterator it = segments_.find(start);
+      if (it != segments_.end() && it->second.end == end && (it->second.refs != 0 || Pin(start, end))) {
+        Acquire(it);
+        registrations_[std::make_pair((uintptr_t)ptr, size)]++;
+        return HSA_STATUS_SUCCESS;
+      }
+      // pin the pages no segment covers yet, and lock the cached pages again, before touching
+      // the tree, so a failure leaves nothing to undo but the new pins. If the lock limit is hit,
+      // the cache makes room and the pages are pinned again.
+      std::vector<std::pair<uintptr_t, uintptr_t>> gaps;
+      std::vector<std::pair<uintptr_t, uintptr_t>> cached;
+      for (int attempt = 0; ; attempt++) {
+        Gaps(start, end, &gaps);
+        Cached(start, end, &cached);
+        size_t pinned = 0;
+        while (pinned < gaps.size() && Pin(gaps[pinned].first, gaps[pinned].second)) {
+          pinned++;
+        }
+        bool locked = (pinned == gaps.size());
+        for (size_t i = 0; locked && i < cached.size(); i++) {
+          locked = Pin(cached[i].first, cached[i].second);
+        }
+        if (locked) {
+          break;
+        }
+        for (size_t i = 0; i < pinned; i++) {
+          Unpin(gaps[i].first, gaps[i].second);
+        }
+        if (attempt == 1 || cached_bytes_ == 0) {
+          return HSA_STATUS_ERROR_OUT_OF_RESOURCES;
+        }
+        Evict(0);
+      }
+      Split(start);
+      Split(end);
+      for (it = segments_.lower_bound(start); it != segments_.end() && it->first < end; ++it) {
+        Acquire(it);
+      }
+      for (size_t i = 0; i < gaps.size(); i++) {
+        Segment segment;
+        segment.end = gaps[i].second;
+        segment.refs = 1;
+        segment.released = 0;
+        segments_[gaps[i].first] = segment;
+      }
+      registrations_[std::make_pair((uintptr_t)ptr, size)]++;
+      return HSA_STATUS_SUCCESS;
+    }
+
+    // Fails unless ptr and size are those of a live registration
+    hsa_status_t Deregister(void* ptr, size_t size) {
+      uintptr_t start, end;
+      PageRange(ptr, size, &start, &end);
+      std::lock_guard<std::mutex> lock(mutex_);
+      std::map<std::pair<uintptr_t, size_t>, uint32_t>::iterator registration =
+        registrations_.find(std::make_pair((uintptr_t)ptr, size));
+      if (registration == registrations_.end()) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+      }
+      if (--registration->second == 0) {
+        registrations_.erase(registration);
+      }
+      // the registration covers all the pages of the range
+      std::map<uintptr_t, Segment>::iterator it = segments_.find(start);
+      if (it == segments_.end() || it->second.end != end) {
+        Split(start);
+        Split(end);
+        it = segments_.lower_bound(start);
+      }
+      for (; it != segments_.end() && it->first < end; ++it) {
+        if (--it->second.refs == 0) {
+          it->second.released = ++clock_;
+          lru_.insert(std::make_pair(it->second.released, it->first));
+          cached_bytes_ += it->second.end - it->first;
+        }
+      }
+      Evict(limit_);
+      return HSA_STATUS_SUCCESS;
+    }
+
+  private:
+    struct Segment {
+      uintptr_t end;
+      // registrations covering the segment; 0 if it is only kept in the cache
+      uint32_t refs;
+      // when the last registration went away
+      uint64_t released;
+    };
+
+    static void PageRange(void* ptr, size_t size, uintptr_t* start, uintptr_t* end) {
+      uintptr_t page = (uintptr_t)PageSize();
+      *start = (uintptr_t)ptr & ~(page - 1);
+      *end = ((uintptr_t)ptr + size + page - 1) & ~(page - 1);
+    }
+
+    void Acquire(std::map<uintptr_t, Segment>::iterator it) {
+      if (it->second.refs++ == 0) {
+        cached_bytes_ -= it->second.end - it->first;
+        lru_.erase(std::make_pair(it->second.released, it->first));
+      }
+    }
+
+    // First segment that ends after address
+    std::map<uintptr_t, Segment>::iterator First(uintptr_t address) {
+      std::map<uintptr_t, Segment>::iterator it = segments_.upper_bound(address);
+      if (it != segments_.begin()) {
+        std::map<uintptr_t, Segment>::iterator prev = it;
+        --prev;
+        if (prev->second.end > address) {
+          return prev;
+        }
+      }
+      return it;
+    }
+
+    // Ranges of [start, end) not covered by any segment
+    void Gaps(uintptr_t start, uintptr_t end, std::vector<std::pair<uintptr_t, uintptr_t>>* gaps) {
+      gaps->clear();
+      uintptr_t curr = start;
+      for (std::map<uintptr_t, Segment>::iterator it = First(start); curr < end; ++it) {
+        uintptr_t next = (it == segments_.end()) ? end : std::min(it->first, end);
+        if (curr < next) {
+          gaps->push_back(std::make_pair(curr, next));
+        }
+        if (it == segments_.end()) {
+          break;
+        }
+        curr = std::max(curr, it->second.end);
+      }
+    }
+
+    // Parts of [start, end) covered by segments that only the cache keeps
+    void Cached(uintptr_t start, uintptr_t end, std::vector<std::pair<uintptr_t, uintptr_t>>* cached) {
+      cached->clear();
+      for (std::map<uintptr_t, Segment>::iterator it = First(start); it != segments_.end() && it->first < end; ++it) {
+        if (it->second.refs == 0) {
+          cached->push_back(std::make_pair(std::max(it->first, start), std::min(it->second.end, end)));
+        }
+      }
+    }
+
+    // Makes address a segment boundary if a segment spans it
+    void Split(uintptr_t address) {
+      std::map<uintptr_t, Segment>::iterator it = First(address);
+      if (it != segments_.end() && it->first < address) {
+        Segment tail = it->second;
+        it->second.end = address;
+        segments_[address] = tail;
+        if (tail.refs == 0) {
+          lru_.insert(std::make_pair(tail.released, address));
+        }
+      }
+    }
+
+    // Unpins cached segments, least recently released first, until at most limit bytes are cached
+    void Evict(size_t limit) {
+      while (cached_bytes_ > limit) {
+        std::map<uintptr_t, Segment>::iterator victim = segments_.find(lru_.begin()->second);
+        lru_.erase(lru_.begin());
+        cached_bytes_ -= victim->second.end - victim->first;
+        Unpin(victim->first, victim->second.end);
+        segments_.erase(victim);
+      }
+    }
+
+    static bool Pin(uintptr_t start, uintptr_t end) {
+#if defined(__linux__)
+      return mlock((void*)start, end - start) == 0;
+#else
+      return true;
+#endif
+    }
+
+    static void Unpin(uintptr_t start, uintptr_t end) {
+#if defined(__linux__)
+      munlock((void*)start, end - start);
+#endif
+    }
+
+    static const size_t kDefaultLimit = 16 * 1024 * 1024;
+
+    std::mutex mutex_;
+    std::map<uintptr_t, Segment> segments_;
+    // the segments no registration covers, by release time and start
+    std::set<std::pair<uint64_t, uintptr_t>> lru_;
+    // number of live registrations of every byte range
+    std::map<std::pair<uintptr_t, size_t>, uint32_t> registrations_;
+    // bytes of the segments no registration covers
+    size_t cached_bytes_;
+    uint64_t clock_;
+    size_t limit_;
+  };
+
+  static RegistrationCache registration_cache_g;
+
+  // Size-class allocator behind the system memory regions. Blocks of up to kMaxSmallSize bytes
+  // are carved from 64 KiB slabs, each slab serving a single size class (multiples of 16 bytes
+  // up to 128, then four classes per power of two). Larger blocks are page-granular and get
+  // pages of their own. All the pages are bound to the NUMA node of the allocator.
+  //
+  // Every thread keeps a magazine of free blocks per allocator and size class, backed by a
+  // per-class global free list, so most Alloc and Free calls touch no shared state. Free finds
+  // the size class in the header at the start of the slab; large blocks are told apart because
+  // they are slab aligned, which a block inside a slab never is.
+  class SlabAllocator {
+  public:
+    explicit SlabAllocator(int node = kAnyNode) : node_(node), slabs_(nullptr) {
+      for (uint32_t i = 0; i < kNumClasses; i++) {
+        depots_[i].free = nullptr;
+        depots_[i].count = 0;
+      }
+      // the first free ID is taken; allocators created while kMaxCachedAllocators others are alive
+      // do without thread caches. The generation of the ID tells the magazines of the previous
+      // owner, which threads may still hold, from the ones of this allocator.
+      id_ = kMaxCachedAllocators;
+      generation_ = 0;
+      for (uint32_t id = 0; id < kMaxCachedAllocators; id++) {
+        SlabAllocator* expected = nullptr;
+        if (allocators_[id].compare_exchange_strong(expected, this, std::memory_order_acq_rel)) {
+          id_ = id;
+          generation_ = generations_[id].load(std::memory_order_acquire);
+          break;
+        }
+      }
+    }
+
+    ~SlabAllocator() {
+      if (id_ < kMaxCachedAllocators) {
+        generations_[id_].fetch_add(1, std::memory_order_release);
+        allocators_[id_].store(nullptr, std::memory_order_release);
+      }
+      while (slabs_ != nullptr) {
+        Slab* next = slabs_->next;
+        UnmapPages(slabs_, kSlabSize);
+        slabs_ = next;
+      }
+      for (std::map<void*, size_t>::iterator it = large_.begin(); it != large_.end(); ++it) {
+        UnmapPages(it->first, it->second);
+      }
+    }
+
+    SlabAllocator(const SlabAllocator&) = delete;
+    SlabAllocator& operator=(SlabAllocator const&) = delete;
+
+    void* Alloc(size_t size) {
+      if (size > kMaxSmallSize) {
+        size_t page = PageSize();
+        size_t length = (size + page - 1) & ~(page - 1);
+        void* ptr = MapPages(length, kSlabSize, node_);
+        if (ptr != nullptr) {
+          std::lock_guard<SpinLock> lock(large_lock_);
+          large_[ptr] = length;
+        }
+        return ptr;
+      }
+      uint32_t size_class = SizeClass(size);
+      Magazine* magazine = LocalMagazine(size_class);
+      if (magazine == nullptr) {
+        Magazine local = { nullptr, 0 };
+        if (!Refill(size_class, &local, 1)) {
+          return nullptr;
+        }
+        return local.head;
+      }
+      if (magazine->head == nullptr && !Refill(size_class, magazine, kThreadCacheSize / 2)) {
+        return nullptr;
+      }
+      Block* block = magazine->head;
+      magazine->head = block->next;
+      magazine->count--;
+      return block;
+    }
+
+    void Free(void* ptr) {
+      if (((uintptr_t)ptr & (kSlabSize - 1)) == 0) {
+        size_t length;
+        {
+          std::lock_guard<SpinLock> lock(large_lock_);
+          std::map<void*, size_t>::iterator it = large_.find(ptr);
+          assert(it != large_.end());
+          length = it->second;
+          large_.erase(it);
+        }
+        UnmapPages(ptr, length);
+        return;
+      }
+      Slab* slab = (Slab*)((uintptr_t)ptr & ~(uintptr_t)(kSlabSize - 1));
+      assert(slab->owner == this);
+      Block* block = (Block*)ptr;
+      Magazine* magazine = LocalMagazine(slab->size_class);
+      if (magazine == nullptr) {
+        Magazine local = { block, 1 };
+        block->next = nullptr;
+        Flush(slab->size_class, &local, 1);
+        return;
+      }
+      block->next = magazine->head;
+      magazine->head = block;
+      if (++magazine->count > kThreadCacheSize) {
+        Flush(slab->size_class, magazine, kThreadCacheSize / 2);
+      }
+    }
+
+    // size and alignment of every block is a multiple of the granule
+    static const size_t kGranule = 16;
+
+  private:
+    struct Block {
+      Block* next;
+    };
+
+    // list of free blocks of one size class
+    struct Magazine {
+      Block* head;
+      size_t count;
+    };
+
+    struct Depot {
+      SpinLock lock;
+      Block* free;
+      size_t count;
+    };
+
+    // header at the start of every slab, followed by the blocks
+    struct alignas(64) Slab {
+      SlabAllocator* owner;
+      Slab* next;
+      uint32_t size_class;
+    };
+
+    static const size_t kSlabSize = 64 * 1024;
+    static const size_t kMaxSmallSize = 8 * 1024;
+    // 8 classes up to 128 bytes, then 4 per power of two up to kMaxSmallSize
+    static const uint32_t kNumClasses = 8 + 4 * 6;
+    static const size_t kThreadCacheSize = 32;
+    static const uint32_t kMaxCachedAllocators = 16;
+
+    struct ThreadCache {
+      ThreadCache() {
+        memset(magazines, 0, sizeof(magazines));
+        memset(generations, 0, sizeof(generations));
+      }
+      ~ThreadCache();
+      Magazine magazines[kMaxCachedAllocators][kNumClasses];
+      // generation of the ID when the magazines of the allocator were last used
+      uint32_t generations[kMaxCachedAllocators];
+    };
+
+    static uint32_t SizeClass(size_t size) {
+      if (size <= 128) {
+        return size == 0 ? 0 : (uint32_t)((size - 1) / 16);
+      }
+      // size is in (2^log, 2^(log + 1)], split in four
+      uint32_t log = Log2(size - 1);
+      return 8 + (log - 7) * 4 + (uint32_t)(((size - 1) >> (log - 2)) & 3);
+    }
+
+    static size_t ClassSize(uint32_t size_class) {
+      if (size_class < 8) {
+        return (size_class + 1) * 16;
+      }
+      uint32_t log = 7 + (size_class - 8) / 4;
+      return ((size_t)1 << log) + ((size_class - 8) % 4 + 1) * ((size_t)1 << (log - 2));
+    }
+
+    static uint32_t Log2(size_t value) {
+#if defined(_MSC_VER)
+      unsigned long index;
+      _BitScanReverse64(&index, value);
+      return index;
+#else
+      return 63 - __builtin_clzll(value);
+#endif
+    }
+
+    Magazine* LocalMagazine(uint32_t size_class) {
+      if (id_ >= kMaxCachedAllocators) {
+        return nullptr;
+      }
+      ThreadCache& cache = cache_;
+      if (cache.generations[id_] != generation_) {
+        // the blocks belonged to a destroyed allocator with the same ID, and are unmapped
+        memset(cache.magazines[id_], 0, sizeof(cache.magazines[id_]));
+        cache.generations[id_] = generation_;
+      }
+      return &cache.magazines[id_][size_class];
+    }
+
+    // Moves up to count free blocks into the magazine, carving a new slab if the global list is
+    // empty. Fails if no memory is left.
+    bool Refill(uint32_t size_class, Magazine* magazine, size_t count) {
+      Depot& depot = depots_[size_class];
+      std::lock_guard<SpinLock> lock(depot.lock);
+      if (depot.free == nullptr && !Carve(size_class)) {
+        return false;
+      }
+      while (count-- > 0 && depot.free != nullptr) {
+        Block* block = depot.free;
+        depot.free = block->next;
+        depot.count--;
+        block->next = magazine->head;
+        magazine->head = block;
+        magazine->count++;
+      }
+      return true;
     }
 
-    hsa_queue_t q_;
+    // Moves count blocks from the magazine back to the global list.
+    void Flush(uint32_t size_class, Magazine* magazine, size_t count) {
+      Depot& depot = depots_[size_class];
+      std::lock_guard<SpinLock> lock(depot.lock);
+      while (count-- > 0) {
+        Block* block = magazine->head;
+        magazine->head = block->next;
+        magazine->count--;
+        block->next = depot.free;
+        depot.free = block;
+        depot.count++;
+      }
+    }
 
-    packet_t *packets_;
-    std::atomic<uint64_t> read_index_;
-    std::atomic<uint64_t> write_index_;
-    Signal doorbell_;
-    queue_callback_t callback_;
-    void* callback_data_;
-    std::thread* packet_processor_;
-    hsa_agent_t agent_;
+    // precondition: the lock of the depot is held
+    bool Carve(uint32_t size_class) {
+      Slab* slab = (Slab*)MapPages(kSlabSize, kSlabSize, node_);
+      if (slab == nullptr) {
+        return false;
+      }
+      slab->owner = this;
+      slab->size_class = size_class;
+      {
+        std::lock_guard<SpinLock> lock(slabs_lock_);
+        slab->next = slabs_;
+        slabs_ = slab;
+      }
+      const size_t size = ClassSize(size_class);
+      Depot& depot = depots_[size_class];
+      uint8_t* end = (uint8_t*)slab + kSlabSize;
+      for (uint8_t* block = (uint8_t*)slab + sizeof(Slab); block + size <= end; block += size) {
+        ((Block*)block)->next = depot.free;
+        depot.free = (Block*)block;
+        depot.count++;
+      }
+      return true;
+    }
+
+    static thread_local ThreadCache cache_;
+    static std::atomic<SlabAllocator*> allocators_[kMaxCachedAllocators];
+    // bumped whenever the allocator holding the ID is destroyed
+    static std::atomic<uint32_t> generations_[kMaxCachedAllocators];
+
+    uint32_t id_;
+    uint32_t generation_;
+    // NUMA node all the memory is bound to, or kAnyNode
+    int node_;
+    Depot depots_[kNumClasses];
+    SpinLock slabs_lock_;
+    Slab* slabs_;
+    // length of every large block
+    SpinLock large_lock_;
+    std::map<void*, size_t> large_;
+  };
+
+  thread_local SlabAllocator::ThreadCache SlabAllocator::cache_;
+  std::atomic<SlabAllocator*> SlabAllocator::allocators_[kMaxCachedAllocators];
+  std::atomic<uint32_t> SlabAllocator::generations_[kMaxCachedAllocators];
+
+  SlabAllocator::ThreadCache::~ThreadCache() {
+    for (uint32_t id = 0; id < kMaxCachedAllocators; id++) {
+      SlabAllocator* allocator = allocators_[id].load(std::memory_order_acquire);
+      if (allocator == nullptr || generations[id] != generations_[id].load(std::memory_order_acquire)) {
+        continue;
+      }
+      for (uint32_t size_class = 0; size_class < kNumClasses; size_class++) {
+        Magazine& magazine = magazines[id][size_class];
+        if (magazine.count != 0) {
+          allocator->Flush(size_class, &magazine, magazine.count);
+        }
+      }
+    }
+  }
+
+  // Global region backed by the memory of one NUMA node
+  class SystemMemory : public Region {
+
+  public:
+    SystemMemory(uint32_t node, uint64_t size) : node_(node), size_(size), allocator_((int)node) {
+    }
+
+    ~SystemMemory() {
+    }
+
+    virtual void* Alloc(size_t size) {
+      return allocator_.Alloc(size);
+    }
+
+    virtual void Free(void* ptr) {
+      allocator_.Free(ptr);
+    }
+
+    virtual hsa_status_t Get(hsa_region_info_t attribute, void* value) const {
+      switch (attribute) {
+      case HSA_REGION_INFO_SEGMENT: {
+        hsa_region_segment_t* dst = (hsa_region_segment_t*)value;
+        *dst = HSA_REGION_SEGMENT_GLOBAL;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_REGION_INFO_GLOBAL_FLAGS: {
+        uint32_t* dst = (uint32_t*)value;
+        *dst = (uint32_t)HSA_REGION_GLOBAL_FLAG_KERNARG | HSA_REGION_GLOBAL_FLAG_FINE_GRAINED;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_REGION_INFO_SIZE: {
+        size_t* dst = (size_t*)value;
+        *dst = (size_t)size_;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_REGION_INFO_ALLOC_MAX_SIZE: {
+        size_t* dst = (size_t*)value;
+        *dst = SIZE_MAX;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_REGION_INFO_RUNTIME_ALLOC_ALLOWED: {
+        bool* dst = (bool*)value;
+        *dst = true;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_REGION_INFO_RUNTIME_ALLOC_GRANULE: {
+        size_t* dst = (size_t*)value;
+        *dst = SlabAllocator::kGranule;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_REGION_INFO_RUNTIME_ALLOC_ALIGNMENT: {
+        size_t* dst = (size_t*)value;
+        *dst = SlabAllocator::kGranule;
+        return HSA_STATUS_SUCCESS;
+      }
+      default: return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+      }
+      return HSA_STATUS_SUCCESS;
+    }
+
+    virtual uint32_t Node() const {
+      return node_;
+    }
+
+  private:
+    uint32_t node_;
+    uint64_t size_;
+    SlabAllocator allocator_;
+  };
+
+  // Coarse-grained global region of one NUMA node. Every block is a whole number of 2 MiB huge
+  // pages, which keeps large working sets from thrashing the TLB; the region records the agent
+  // each block is assigned to.
+  class CoarseMemory : public Region {
+
+  public:
+    CoarseMemory(uint32_t node, uint64_t size) : node_(node), size_(size) {
+    }
+
+    ~CoarseMemory() {
+      for (std::map<void*, Block>::iterator it = blocks_.begin(); it != blocks_.end(); ++it) {
+        UnmapPages(it->first, it->second.length);
+      }
+    }
+
+    virtual void* Alloc(size_t size) {
+      size_t length = (size + kHugePageSize - 1) & ~(kHugePageSize - 1);
+      if (length < size) {
+        return nullptr;
+      }
+      void* ptr = MapHugePages(length, (int)node_);
+      if (ptr == nullptr) {
+        return nullptr;
+      }
+      Block block;
+      block.length = length;
+      // unassigned until the first hsa_memory_assign_agent
+      block.owner.handle = 0;
+      block.access = HSA_ACCESS_PERMISSION_RW;
+      std::lock_guard<std::mutex> lock(mutex_);
+      blocks_[ptr] = block;
+      return ptr;
+    }
+
+    virtual void Free(void* ptr) {
+      size_t length;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::map<void*, Block>::iterator it = blocks_.find(ptr);
+        assert(it != blocks_.end());
+        length = it->second.length;
+        blocks_.erase(it);
+      }
+      UnmapPages(ptr, length);
+    }
+
+    virtual hsa_status_t AssignAgent(void* ptr, hsa_agent_t agent, hsa_access_permission_t access) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      std::map<void*, Block>::iterator it = blocks_.find(ptr);
+      if (it == blocks_.end()) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+      }
+      it->second.owner = agent;
+      it->second.access = access;
+      return HSA_STATUS_SUCCESS;
+    }
+
+    virtual hsa_status_t Get(hsa_region_info_t attribute, void* value) const {
+      switch (attribute) {
+      case HSA_REGION_INFO_SEGMENT: {
+        hsa_region_segment_t* dst = (hsa_region_segment_t*)value;
+        *dst = HSA_REGION_SEGMENT_GLOBAL;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_REGION_INFO_GLOBAL_FLAGS: {
+        uint32_t* dst = (uint32_t*)value;
+        *dst = (uint32_t)HSA_REGION_GLOBAL_FLAG_COARSE_GRAINED;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_REGION_INFO_SIZE: {
+        size_t* dst = (size_t*)value;
+        *dst = (size_t)size_;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_REGION_INFO_ALLOC_MAX_SIZE: {
+        size_t* dst = (size_t*)value;
+        *dst = SIZE_MAX & ~(kHugePageSize - 1);
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_REGION_INFO_RUNTIME_ALLOC_ALLOWED: {
+        bool* dst = (bool*)value;
+        *dst = true;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_REGION_INFO_RUNTIME_ALLOC_GRANULE:
+      case HSA_REGION_INFO_RUNTIME_ALLOC_ALIGNMENT: {
+        size_t* dst = (size_t*)value;
+        *dst = kHugePageSize;
+        return HSA_STATUS_SUCCESS;
+      }
+      default: return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+      }
+      return HSA_STATUS_SUCCESS;
+    }
+
+    virtual uint32_t Node() const {
+      return node_;
+    }
+
+  private:
+    struct Block {
+      size_t length;
+      hsa_agent_t owner;
+      hsa_access_permission_t access;
+    };
+
+    uint32_t node_;
+    uint64_t size_;
+    std::mutex mutex_;
+    std::map<void*, Block> blocks_;
+  };
+
+
+  class Agent {
+  public:
+
+    virtual hsa_status_t Get(hsa_agent_info_t attribute, void* value) const = 0;
+
+    virtual hsa_status_t IterateRegions(hsa_status_t(*callback)(hsa_region_t region, void* data), void* data) = 0;
+
+    virtual hsa_status_t IterateCaches(hsa_status_t(*callback)(hsa_cache_t cache, void* data), void* data) = 0;
+
+    virtual hsa_status_t IterateIsas(hsa_status_t(*callback)(hsa_isa_t isa, void* data), void* data) = 0;
+  };
+
+  class HostAgent : Agent {
+
+  public:
+
+    // The threads of the agent run on the CPUs of partition. regions holds the regions of every
+    // node; the agent lists the ones on its own node first.
+    // caches holds the caches of every CPU; the agent keeps the ones its CPUs use, by level.
+    // isas holds the ISAs of the CPUs, widest vectors first.
+    HostAgent(const CpuPartition& partition, const std::vector<Region*>& regions, const std::vector<Cache*>& caches,
+      const std::vector<const Isa*>& isas, bool agent_dispatch_enabled = false) : isas_(isas) {
+      uint32_t node = partition.node;
+      node_ = node;
+      cpus_ = partition.cpus;
+      num_cores_ = partition.num_cores;
+      for (size_t i = 0; i < regions.size(); i++) {
+        if (regions[i]->Node() == node) {
+          regions_.push_back(regions[i]);
+        }
+      }
+      for (size_t i = 0; i < regions.size(); i++) {
+        if (regions[i]->Node() != node) {
+          regions_.push_back(regions[i]);
+        }
+      }
+
+      for (size_t i = 0; i < caches.size(); i++) {
+        if (caches[i]->Serves(cpus_)) {
+          caches_.push_back(caches[i]);
+        }
+      }
+      std::stable_sort(caches_.begin(), caches_.end(), [](const Cache* a, const Cache* b) {
+        return a->Level() < b->Level();
+      });
+
+      agent_dispatch_enabled_ = agent_dispatch_enabled;
+      workers_ = nullptr;
+      scheduler_ = nullptr;
+    }
+
+    virtual ~HostAgent(){
+      delete scheduler_;
+      delete workers_;
+    }
+
+    // Worker threads are only started once the first kernel dispatch queue is created
+    WorkerPool* Workers() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (workers_ == nullptr) {
+        // the packet processor thread running a dispatch is the remaining participant
+        workers_ = new WorkerPool(NumCpus() - 1, cpus_);
+      }
+      return workers_;
+    }
+
+    // Packet processor threads are only started once the first kernel dispatch queue is created
+    QueueScheduler* Scheduler() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (scheduler_ == nullptr) {
+        uint32_t cpus = NumCpus();
+        scheduler_ = new QueueScheduler(cpus < kMaxProcessorThreads ? cpus : kMaxProcessorThreads, cpus_);
+      }
+      return scheduler_;
+    }
+
+    virtual hsa_status_t Get(hsa_agent_info_t attribute, void* value) const {
+      if (attribute == HSA_CPU_AGENT_INFO_COMPUTE_UNIT_COUNT) {
+        uint32_t* dst = (uint32_t*)value;
+        *dst = num_cores_;
+        return HSA_STATUS_SUCCESS;
+      }
+      if (attribute == HSA_CPU_AGENT_INFO_CPU_COUNT) {
+        uint32_t* dst = (uint32_t*)value;
+        *dst = (uint32_t)cpus_.size();
+        return HSA_STATUS_SUCCESS;
+      }
+      switch (attribute) {
+      case HSA_AGENT_INFO_ISA: {
+        hsa_isa_t* dst = (hsa_isa_t*)value;
+        dst->handle = (uint64_t)isas_[0];
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_AGENT_INFO_WAVEFRONT_SIZE:
+        return isas_[0]->Get(HSA_ISA_INFO_CALL_CONVENTION_INFO_WAVEFRONT_SIZE, value);
+      case HSA_AGENT_INFO_WORKGROUP_MAX_DIM:
+        return isas_[0]->Get(HSA_ISA_INFO_WORKGROUP_MAX_DIM, value);
+      case HSA_AGENT_INFO_WORKGROUP_MAX_SIZE:
+        return isas_[0]->Get(HSA_ISA_INFO_WORKGROUP_MAX_SIZE, value);
+      case HSA_AGENT_INFO_GRID_MAX_DIM:
+        return isas_[0]->Get(HSA_ISA_INFO_GRID_MAX_DIM, value);
+      case HSA_AGENT_INFO_GRID_MAX_SIZE:
+        return isas_[0]->Get(HSA_ISA_INFO_GRID_MAX_SIZE, value);
+      case HSA_AGENT_INFO_FBARRIER_MAX_SIZE:
+        return isas_[0]->Get(HSA_ISA_INFO_FBARRIER_MAX_SIZE, value);
+      case HSA_AGENT_INFO_DEVICE: {
+        hsa_device_type_t* dst = (hsa_device_type_t*)value;
+        *dst = HSA_DEVICE_TYPE_CPU;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_AGENT_INFO_FEATURE: {
+        uint32_t* dst = (uint32_t*)value;
+        *dst = agent_dispatch_enabled_ ? HSA_AGENT_FEATURE_AGENT_DISPATCH : HSA_AGENT_FEATURE_KERNEL_DISPATCH;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_AGENT_INFO_QUEUE_TYPE: {
+        hsa_queue_type_t* dst = (hsa_queue_type_t*)value;
+        *dst = HSA_QUEUE_TYPE_MULTI;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_AGENT_INFO_QUEUES_MAX: {
+        uint32_t* dst = (uint32_t*)value;
+        *dst = QueueScheduler::kMaxQueues;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_AGENT_INFO_NODE: {
+        uint32_t* dst = (uint32_t*)value;
+        *dst = node_;
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_AGENT_INFO_CACHE_SIZE: {
+        // the first (data or unified) cache of every level
+        uint32_t* dst = (uint32_t*)value;
+        memset(dst, 0, 4 * sizeof(uint32_t));
+        for (size_t i = caches_.size(); i-- > 0; ) {
+          if (caches_[i]->Level() >= 1 && caches_[i]->Level() <= 4) {
+            dst[caches_[i]->Level() - 1] = caches_[i]->Size();
+          }
+        }
+        return HSA_STATUS_SUCCESS;
+      }
+        // Fill as needed
+      default: return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+      }
+      return HSA_STATUS_SUCCESS;
+    }
+
+    virtual hsa_status_t IterateCaches(hsa_status_t(*callback)(hsa_cache_t cache, void* data), void* data) {
+      for (size_t i = 0; i < caches_.size(); i++) {
+        hsa_cache_t c;
+        c.handle = (uint64_t)caches_[i];
+        hsa_status_t stat = callback(c, data);
+        if (stat != HSA_STATUS_SUCCESS) {
+          return stat;
+        }
+      }
+      return HSA_STATUS_SUCCESS;
+    }
+
+    virtual hsa_status_t IterateIsas(hsa_status_t(*callback)(hsa_isa_t isa, void* data), void* data) {
+      for (size_t i = 0; i < isas_.size(); i++) {
+        hsa_isa_t isa;
+        isa.handle = (uint64_t)isas_[i];
+        hsa_status_t stat = callback(isa, data);
+        if (stat != HSA_STATUS_SUCCESS) {
+          return stat;
+        }
+      }
+      return HSA_STATUS_SUCCESS;
+    }
+
+    // local memory first, so callers that take the first suitable region get local memory
+    virtual hsa_status_t IterateRegions(hsa_status_t(*callback)(hsa_region_t region, void* data), void* data) {
+      for (size_t i = 0; i < regions_.size(); i++) {
+        hsa_region_t r;
+        r.handle = (uint64_t)regions_[i];
+        hsa_status_t stat = callback(r, data);
+        if (stat != HSA_STATUS_SUCCESS) {
+          return stat;
+        }
+      }
+      return HSA_STATUS_SUCCESS;
+    }
+
+  private:
+    // an agent without CPUs of its own runs its threads anywhere
+    uint32_t NumCpus() const {
+      return cpus_.empty() ? std::max(std::thread::hardware_concurrency(), 1u) : (uint32_t)cpus_.size();
+    }
+
+    uint32_t node_;
+    std::vector<uint32_t> cpus_;
+    uint32_t num_cores_;
+    std::vector<Region*> regions_;
+    std::vector<Cache*> caches_;
+    std::vector<const Isa*> isas_;
+    bool agent_dispatch_enabled_;
+    std::mutex mutex_;
+    WorkerPool* workers_;
+    QueueScheduler* scheduler_;
+
+    // queues are serviced by at most this many packet processor threads
+    static const uint32_t kMaxProcessorThreads = 4;
   };
 
+  WorkerPool* GetWorkerPool(hsa_agent_t agent) {
+    return ((HostAgent*) agent.handle)->Workers();
+  }
+
+  QueueScheduler* GetQueueScheduler(hsa_agent_t agent) {
+    return ((HostAgent*) agent.handle)->Scheduler();
+  }
+
+  static hsa_status_t FindKernargRegion(hsa_region_t region, void* data) {
+    uint32_t flags = 0;
+    hsa_region_get_info(region, HSA_REGION_INFO_GLOBAL_FLAGS, &flags);
+    if (flags & HSA_REGION_GLOBAL_FLAG_KERNARG) {
+      *(hsa_region_t*)data = region;
+      return HSA_STATUS_INFO_BREAK;
+    }
+    return HSA_STATUS_SUCCESS;
+  }
+
+  bool KernargArena::Init() {
+    hsa_region_t region;
+    region.handle = 0;
+    hsa_agent_iterate_regions(agent_, FindKernargRegion, &region);
+    if (region.handle == 0) {
+      return false;
+    }
+    buffer_ = ((Region*)region.handle)->Alloc(capacity_ + alignment_);
+    if (buffer_ == nullptr) {
+      return false;
+    }
+    base_ = (uint8_t*)RoundUp((size_t)buffer_, alignment_);
+    return true;
+  }
 
-  class Region {
-  public:
-    virtual void* Alloc(size_t size) = 0;
+  KernargArena::~KernargArena() {
+    if (buffer_ != nullptr) {
+      hsa_region_t region;
+      region.handle = 0;
+      hsa_agent_iterate_regions(agent_, FindKernargRegion, &region);
+      ((Region*)region.handle)->Free(buffer_);
+    }
+  }
 
-    virtual void Free(void* ptr) = 0;
 
-    virtual hsa_status_t Get(hsa_region_info_t attribute, void* value) const = 0;
-  };
+  // SIMD copy loops. The destination is aligned to the vector width first; with stream set the
+  // stores bypass the caches, which pays off once the copy no longer fits in them.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HSA_SIMD_COPY 1
+
+  static void CopySse2(uint8_t* dst, const uint8_t* src, size_t size, bool stream) {
+    size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+    memcpy(dst, src, head);
+    dst += head, src += head, size -= head;
+    for (; size >= 64; dst += 64, src += 64, size -= 64) {
+      __m128i a = _mm_loadu_si128((const __m128i*)src);
+      __m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+      __m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+      __m128i d = _mm_loadu_si128((const __m128i*)(src + 48));
+      if (stream) {
+        _mm_stream_si128((__m128i*)dst, a);
+        _mm_stream_si128((__m128i*)(dst + 16), b);
+        _mm_stream_si128((__m128i*)(dst + 32), c);
+        _mm_stream_si128((__m128i*)(dst + 48), d);
+      } else {
+        _mm_store_si128((__m128i*)dst, a);
+        _mm_store_si128((__m128i*)(dst + 16), b);
+        _mm_store_si128((__m128i*)(dst + 32), c);
+        _mm_store_si128((__m128i*)(dst + 48), d);
+      }
+    }
+    memcpy(dst, src, size);
+  }
 
-  class SystemMemory  {
+  __attribute__((target("avx2")))
+  static void CopyAvx2(uint8_t* dst, const uint8_t* src, size_t size, bool stream) {
+    size_t head = (32 - ((uintptr_t)dst & 31)) & 31;
+    memcpy(dst, src, head);
+    dst += head, src += head, size -= head;
+    for (; size >= 128; dst += 128, src += 128, size -= 128) {
+      __m256i a = _mm256_loadu_si256((const __m256i*)src);
+      __m256i b = _mm256_loadu_si256((const __m256i*)(src + 32));
+      __m256i c = _mm256_loadu_si256((const __m256i*)(src + 64));
+      __m256i d = _mm256_loadu_si256((const __m256i*)(src + 96));
+      if (stream) {
+        _mm256_stream_si256((__m256i*)dst, a);
+        _mm256_stream_si256((__m256i*)(dst + 32), b);
+        _mm256_stream_si256((__m256i*)(dst + 64), c);
+        _mm256_stream_si256((__m256i*)(dst + 96), d);
+      } else {
+        _mm256_store_si256((__m256i*)dst, a);
+        _mm256_store_si256((__m256i*)(dst + 32), b);
+        _mm256_store_si256((__m256i*)(dst + 64), c);
+        _mm256_store_si256((__m256i*)(dst + 96), d);
+      }
+    }
+    memcpy(dst, src, size);
+  }
 
-  public:
-    SystemMemory() {
+  __attribute__((target("avx512f")))
+  static void CopyAvx512(uint8_t* dst, const uint8_t* src, size_t size, bool stream) {
+    size_t head = (64 - ((uintptr_t)dst & 63)) & 63;
+    memcpy(dst, src, head);
+    dst += head, src += head, size -= head;
+    for (; size >= 256; dst += 256, src += 256, size -= 256) {
+      __m512i a = _mm512_loadu_si512((const void*)src);
+      __m512i b = _mm512_loadu_si512((const void*)(src + 64));
+      __m512i c = _mm512_loadu_si512((const void*)(src + 128));
+      __m512i d = _mm512_loadu_si512((const void*)(src + 192));
+      if (stream) {
+        _mm512_stream_si512((__m512i*)dst, a);
+        _mm512_stream_si512((__m512i*)(dst + 64), b);
+        _mm512_stream_si512((__m512i*)(dst + 128), c);
+        _mm512_stream_si512((__m512i*)(dst + 192), d);
+      } else {
+        _mm512_store_si512((__m512i*)dst, a);
+        _mm512_store_si512((__m512i*)(dst + 64), b);
+        _mm512_store_si512((__m512i*)(dst + 128), c);
+        _mm512_store_si512((__m512i*)(dst + 192), d);
+      }
     }
+    memcpy(dst, src, size);
+  }
+#endif
 
-    ~SystemMemory() {
+  // Engine behind hsa_memory_copy. Small copies go to memcpy, larger ones to the widest SIMD loop
+  // the CPU supports; past the streaming threshold the loop uses non-temporal stores, and past
+  // the parallel threshold the copy is split over a pool of threads. The thresholds are set by
+  // Init from the size of the last level cache, and can be overridden with
+  // HSA_COPY_STREAM_THRESHOLD and HSA_COPY_PARALLEL_THRESHOLD (in bytes).
+  class CopyEngine {
+  public:
+    CopyEngine() : copy_(nullptr), stream_threshold_(kDefaultStreamThreshold),
+      parallel_threshold_(kDefaultParallelThreshold), workers_(nullptr) {
     }
 
-    virtual void* Alloc(size_t size) {
-      return malloc(size);
+    ~CopyEngine() {
+      delete workers_;
     }
 
-    virtual void Free(void* ptr) {
-      return free(ptr);
+    CopyEngine(const CopyEngine&) = delete;
+    CopyEngine& operator=(CopyEngine const&) = delete;
+
+    // Only the first call has an effect. The thresholds are written before the copy loop is
+    // published, and never again, so Copy can read them without a lock.
+    void Init() {
+      std::call_once(init_, [this]() {
+        // cached stores only make sense while source and destination fit in the cache together
+        size_t cache = LastLevelCacheSize();
+        stream_threshold_ = (cache != 0) ? cache / 2 : kDefaultStreamThreshold;
+        stream_threshold_ = Threshold("HSA_COPY_STREAM_THRESHOLD", stream_threshold_);
+        parallel_threshold_ = Threshold("HSA_COPY_PARALLEL_THRESHOLD", kDefaultParallelThreshold);
+#if defined(HSA_SIMD_COPY)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+          copy_.store(CopyAvx512, std::memory_order_release);
+        } else if (__builtin_cpu_supports("avx2")) {
+          copy_.store(CopyAvx2, std::memory_order_release);
+        } else {
+          copy_.store(CopySse2, std::memory_order_release);
+        }
+#endif
+      });
     }
 
-    virtual hsa_status_t Get(hsa_region_info_t attribute, void* value) const {
-      switch (attribute) {
-      case HSA_REGION_INFO_SEGMENT: {
-        hsa_region_segment_t* dst = (hsa_region_segment_t*)value;
-        *dst = HSA_REGION_SEGMENT_GLOBAL;
-        return HSA_STATUS_SUCCESS;
-      }
-      case HSA_REGION_INFO_GLOBAL_FLAGS: {
-        uint32_t* dst = (uint32_t*)value;
-        *dst = (uint32_t)HSA_REGION_GLOBAL_FLAG_KERNARG | HSA_REGION_GLOBAL_FLAG_FINE_GRAINED;
-        return HSA_STATUS_SUCCESS;
-      }
-      case HSA_REGION_INFO_ALLOC_MAX_SIZE: {
-        size_t* dst = (size_t*)value;
-        *dst = SIZE_MAX;
-        return HSA_STATUS_SUCCESS;
+    void Copy(void* dst, const void* src, size_t size) {
+      copy_t copy = copy_.load(std::memory_order_acquire);
+      if (copy == nullptr || size < kSimdThreshold) {
+        memcpy(dst, src, size);
+        return;
       }
-      case HSA_REGION_INFO_RUNTIME_ALLOC_GRANULE: {
-        size_t* dst = (size_t*)value;
-        *dst = 1;
-        return HSA_STATUS_SUCCESS;
+      bool stream = size >= stream_threshold_;
+      WorkerPool* workers = (size >= parallel_threshold_) ? Workers() : nullptr;
+      uint64_t num_chunks = 0;
+      if (workers != nullptr) {
+        num_chunks = std::min((uint64_t)workers->NumThreads() * kChunksPerThread, (uint64_t)(size / kMinChunkSize));
       }
-      case HSA_REGION_INFO_RUNTIME_ALLOC_ALIGNMENT: {
-        size_t* dst = (size_t*)value;
-        *dst = 1;
-        return HSA_STATUS_SUCCESS;
+      if (num_chunks > 1) {
+        // chunk boundaries on cache lines of the destination, so no two threads write the same line
+        const uintptr_t base = (uintptr_t)dst;
+        const size_t chunk = size / num_chunks;
+        auto boundary = [=](uint64_t i) -> size_t {
+          if (i == 0 || i == num_chunks) {
+            return (i == 0) ? 0 : size;
+          }
+          return (size_t)(((base + i * chunk) & ~(uintptr_t)63) - base);
+        };
+        workers->Run(num_chunks, [=](uint64_t i) {
+          size_t offset = boundary(i);
+          CopyChunk(copy, (uint8_t*)dst + offset, (const uint8_t*)src + offset, boundary(i + 1) - offset, stream);
+        });
+        return;
       }
-      default: return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+      CopyChunk(copy, (uint8_t*)dst, (const uint8_t*)src, size, stream);
+    }
+
+  private:
+    typedef void(*copy_t)(uint8_t* dst, const uint8_t* src, size_t size, bool stream);
+
+    static void CopyChunk(copy_t copy, uint8_t* dst, const uint8_t* src, size_t size, bool stream) {
+      copy(dst, src, size, stream);
+#if defined(HSA_SIMD_COPY)
+      if (stream) {
+        // streaming stores are weakly ordered
+        _mm_sfence();
       }
-      return HSA_STATUS_SUCCESS;
+#endif
     }
 
-    hsa_agent_t agent_;
-    uint32_t bandwidth_;
-    uint32_t node_;
-  };
+    WorkerPool* Workers() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (workers_ == nullptr) {
+        uint32_t cores = std::max(std::thread::hardware_concurrency(), 1u);
+        // a few threads already saturate the memory bandwidth of a node
+        workers_ = new WorkerPool((cores < kMaxThreads ? cores : kMaxThreads) - 1);
+      }
+      return workers_;
+    }
 
+    static size_t Threshold(const char* name, size_t value) {
+      const char* env = getenv(name);
+      return (env != nullptr) ? (size_t)strtoull(env, nullptr, 10) : value;
+    }
 
-  class Agent {
-  public:
+    static size_t LastLevelCacheSize() {
+#if defined(_SC_LEVEL3_CACHE_SIZE)
+      long size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+      if (size <= 0) {
+        size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+      }
+      return size > 0 ? (size_t)size : 0;
+#else
+      return 0;
+#endif
+    }
 
-    virtual hsa_status_t Get(hsa_agent_info_t attribute, void* value) const = 0;
+    // below this the call overhead of the SIMD loops is not worth it
+    static const size_t kSimdThreshold = 512;
+    static const size_t kDefaultStreamThreshold = 8 * 1024 * 1024;
+    static const size_t kDefaultParallelThreshold = 4 * 1024 * 1024;
+    static const size_t kMinChunkSize = 1024 * 1024;
+    static const uint64_t kChunksPerThread = 4;
+    static const uint32_t kMaxThreads = 8;
 
-    virtual hsa_status_t IterateRegions(hsa_status_t(*callback)(hsa_region_t region, void* data), void* data) = 0;
+    std::once_flag init_;
+    std::mutex mutex_;
+    std::atomic<copy_t> copy_;
+    size_t stream_threshold_;
+    size_t parallel_threshold_;
+    WorkerPool* workers_;
   };
 
-  class HostAgent : Agent {
+  static CopyEngine copy_engine_g;
 
+  // Background copy service, the CPU counterpart of a DMA engine. Requests are queued and run
+  // by kNumThreads copy threads in submission order; each starts once all its dependency
+  // signals are 0 and decrements its completion signal when done. Copy threads never wait for
+  // dependencies: a request whose dependencies are not satisfied is set aside with a listener
+  // attached to them, and queued again once one of them is updated. Copies overlap with each
+  // other and with kernels running on the agents. The threads start with the first request.
+  class AsyncCopyEngine {
   public:
+    AsyncCopyEngine() : stop_(false), notified_(false) {
+    }
 
-    HostAgent(bool agent_dispatch_enabled = false) {
-      region_.agent_.handle = (uint64_t) this;
-      region_.bandwidth_ = 0;
-      region_.node_ = 0;
-
-      agent_dispatch_enabled_ = agent_dispatch_enabled;
+    ~AsyncCopyEngine() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+      }
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      event_.Notify();
+      for (size_t i = 0; i < threads_.size(); i++) {
+        threads_[i]->join();
+        delete threads_[i];
+      }
+      for (size_t i = 0; i < requests_.size(); i++) {
+        Detach(requests_[i]);
+        delete requests_[i];
+      }
+      for (size_t i = 0; i < blocked_.size(); i++) {
+        Detach(blocked_[i]);
+        delete blocked_[i];
+      }
     }
 
-    ~HostAgent(){
+    AsyncCopyEngine(const AsyncCopyEngine&) = delete;
+    AsyncCopyEngine& operator=(AsyncCopyEngine const&) = delete;
+
+    // The signals are looked up when the request runs, not when it is submitted.
+    void Submit(void* dst, const void* src, size_t size, uint32_t num_deps, const hsa_signal_t* deps,
+      hsa_signal_t completion) {
+      Request* request = new Request(this);
+      request->dst = dst;
+      request->src = src;
+      request->size = size;
+      request->deps.assign(deps, deps + num_deps);
+      request->completion = completion;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (threads_.empty()) {
+          for (uint32_t i = 0; i < kNumThreads; i++) {
+            threads_.push_back(new std::thread(&AsyncCopyEngine::Work, this));
+          }
+        }
+        requests_.push_back(request);
+      }
+      // pairs with the fence in Event::Wait
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      event_.Notify();
     }
 
-    virtual hsa_status_t Get(hsa_agent_info_t attribute, void* value) const {
-      switch (attribute) {
-      case HSA_AGENT_INFO_DEVICE: {
-        hsa_device_type_t* dst = (hsa_device_type_t*)value;
-        *dst = HSA_DEVICE_TYPE_CPU;
-        return HSA_STATUS_SUCCESS;
+  private:
+    // While set aside, a request is the listener of its dependencies.
+    struct Request : public SignalListener {
+      explicit Request(AsyncCopyEngine* engine) : engine(engine), listening(false), notified(false) {
       }
-      case HSA_AGENT_INFO_FEATURE: {
-        uint32_t* dst = (uint32_t*)value;
-        *dst = agent_dispatch_enabled_ ? HSA_AGENT_FEATURE_AGENT_DISPATCH : HSA_AGENT_FEATURE_KERNEL_DISPATCH;
-        return HSA_STATUS_SUCCESS;
+
+      // Called with the listener lock of the updated signal held
+      virtual void Notify() {
+        notified.store(true, std::memory_order_release);
+        engine->notified_.store(true, std::memory_order_release);
+        // pairs with the fence in Event::Wait
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        engine->event_.Notify();
       }
-      case HSA_AGENT_INFO_QUEUE_TYPE: {
-        hsa_queue_type_t* dst = (hsa_queue_type_t*)value;
-        *dst = HSA_QUEUE_TYPE_MULTI;
-        return HSA_STATUS_SUCCESS;
+
+      AsyncCopyEngine* engine;
+      void* dst;
+      const void* src;
+      size_t size;
+      std::vector<hsa_signal_t> deps;
+      hsa_signal_t completion;
+      // the dependencies the request is attached to, and the links attaching it
+      bool listening;
+      std::vector<Signal*> attached;
+      std::vector<SignalListenerLink> links;
+      // a dependency was updated since the request was last examined
+      std::atomic<bool> notified;
+    };
+
+    // Dependencies that are no longer valid signals are taken as satisfied
+    static bool Satisfied(const Request& request) {
+      for (size_t i = 0; i < request.deps.size(); i++) {
+        Signal* signal = signal_pool_g.Lookup(request.deps[i].handle);
+        if (signal != nullptr && signal->Load(std::memory_order_acquire) != 0) {
+          return false;
+        }
       }
-        // Fill as needed
-      default: return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+      return true;
+    }
+
+    static void Attach(Request* request) {
+      request->links.resize(request->deps.size());
+      for (size_t i = 0; i < request->deps.size(); i++) {
+        Signal* signal = signal_pool_g.Lookup(request->deps[i].handle);
+        if (signal != nullptr) {
+          SignalListenerLink& link = request->links[request->attached.size()];
+          link.listener = request;
+          signal->AttachListener(&link);
+          request->attached.push_back(signal);
+        }
       }
-      return HSA_STATUS_SUCCESS;
+      request->listening = true;
     }
 
-    virtual hsa_status_t IterateRegions(hsa_status_t(*callback)(hsa_region_t region, void* data), void* data) {
-      hsa_region_t r;
-      r.handle = (uint64_t)&region_;
-      return callback(r, data);
+    static void Detach(Request* request) {
+      for (size_t i = 0; i < request->attached.size(); i++) {
+        request->attached[i]->DetachListener(&request->links[i]);
+      }
+      request->attached.clear();
+      request->listening = false;
     }
 
-  private:
-    SystemMemory region_;
-    bool agent_dispatch_enabled_;
+    void Work() {
+      while (true) {
+        Request* request;
+        event_.Wait([&]() {
+          if (notified_.load(std::memory_order_acquire)) {
+            return true;
+          }
+          std::lock_guard<std::mutex> lock(mutex_);
+          return stop_ || !requests_.empty();
+        });
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          if (stop_) {
+            return;
+          }
+          if (notified_.exchange(false, std::memory_order_acq_rel)) {
+            // queue again the requests set aside whose dependencies were updated
+            for (size_t i = 0; i < blocked_.size();) {
+              if (blocked_[i]->notified.exchange(false, std::memory_order_acq_rel)) {
+                requests_.push_back(blocked_[i]);
+                blocked_[i] = blocked_.back();
+                blocked_.pop_back();
+              } else {
+                i++;
+              }
+            }
+          }
+          if (requests_.empty()) {
+            // another copy thread took it
+            continue;
+          }
+          request = requests_.front();
+          requests_.pop_front();
+        }
+        if (!Satisfied(*request)) {
+          if (!request->listening) {
+            Attach(request);
+          }
+          // a dependency updated before the listener was attached did not notify us
+          if (!Satisfied(*request)) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (request->notified.exchange(false, std::memory_order_acq_rel)) {
+              requests_.push_back(request);
+            } else {
+              blocked_.push_back(request);
+            }
+            continue;
+          }
+        }
+        Detach(request);
+        copy_engine_g.Copy(request->dst, request->src, request->size);
+        Signal* completion = signal_pool_g.Lookup(request->completion.handle);
+        if (completion != nullptr) {
+          completion->Subtract(1, std::memory_order_release);
+        }
+        delete request;
+      }
+    }
+
+    static const uint32_t kNumThreads = 2;
+
+    std::mutex mutex_;
+    std::deque<Request*> requests_;
+    // requests waiting for an update of their dependencies
+    std::vector<Request*> blocked_;
+    bool stop_;
+    // some request set aside was notified
+    std::atomic<bool> notified_;
+    Event event_;
+    std::vector<std::thread*> threads_;
   };
 
+  static AsyncCopyEngine async_copy_engine_g;
 
   class Runtime {
   public:
@@ -431,6 +3950,11 @@ namespace hsa {
     }
 
     hsa_status_t Get(hsa_system_info_t attribute, void* value) const {
+      // profiling code reads the timestamp in tight loops
+      if (attribute == HSA_SYSTEM_INFO_TIMESTAMP) {
+        *(uint64_t*)value = timestamp_g.Now();
+        return HSA_STATUS_SUCCESS;
+      }
       switch (attribute) {
       case HSA_SYSTEM_INFO_VERSION_MAJOR: {
         uint16_t* dst = (uint16_t*)value;
@@ -441,6 +3965,16 @@ namespace hsa {
         uint16_t* dst = (uint16_t*)value;
         *dst = 0;
         return HSA_STATUS_SUCCESS;
+      }
+      case HSA_SYSTEM_INFO_TIMESTAMP_FREQUENCY: {
+        uint64_t* dst = (uint64_t*)value;
+        *dst = timestamp_g.Frequency();
+        return HSA_STATUS_SUCCESS;
+      }
+      case HSA_SYSTEM_INFO_SIGNAL_MAX_WAIT: {
+        uint64_t* dst = (uint64_t*)value;
+        *dst = UINT64_MAX;
+        return HSA_STATUS_SUCCESS;
       }
         // Fill as needed
       default: return HSA_STATUS_ERROR_INVALID_ARGUMENT;
@@ -467,10 +4001,41 @@ namespace hsa {
       }
       ref_count_++;
       if (ref_count_ == 1) {
+        copy_engine_g.Init();
+        timestamp_g.Init();
+        std::vector<NumaNode> nodes = DiscoverNumaNodes();
+        // a fine-grained and a coarse-grained region per node. Regions are created the first time
+        // their node shows up and then serve every later initialization: the allocation index and
+        // the slab allocators only have IDs for a limited number of them.
+        regions_.reset(new std::vector<Region*>());
+        for (size_t i = 0; i < nodes.size(); i++) {
+          size_t found = 0;
+          for (size_t j = 0; j < all_regions_.size(); j++) {
+            if (all_regions_[j]->Node() == nodes[i].id) {
+              regions_.get()->push_back(all_regions_[j]);
+              found++;
+            }
+          }
+          if (found == 0) {
+            all_regions_.push_back(new SystemMemory(nodes[i].id, nodes[i].memory));
+            all_regions_.push_back(new CoarseMemory(nodes[i].id, nodes[i].memory));
+            regions_.get()->insert(regions_.get()->end(), all_regions_.end() - 2, all_regions_.end());
+          }
+        }
+        // a kernel agent per CPU partition, then the agent dispatch agent; the latter is served by
+        // application threads, so it has no CPUs of its own
+        std::vector<Cpu> cpus = DiscoverCpus(nodes);
+        caches_.reset(new std::vector<Cache*>(DiscoverCaches(cpus)));
+        std::vector<const Isa*> isas = DetectIsas();
+        std::vector<CpuPartition> partitions = PartitionCpus(cpus);
         agents_.reset(new std::vector<HostAgent*>());
-        agents_.get()->push_back(new HostAgent());
-        agents_.get()->push_back(new HostAgent());
-        agents_.get()->push_back(new HostAgent(true));
+        for (size_t i = 0; i < partitions.size(); i++) {
+          agents_.get()->push_back(new HostAgent(partitions[i], *regions_.get(), *caches_.get(), isas));
+        }
+        CpuPartition none;
+        none.node = partitions[0].node;
+        none.num_cores = 0;
+        agents_.get()->push_back(new HostAgent(none, *regions_.get(), *caches_.get(), isas, true));
       }
       return HSA_STATUS_SUCCESS;
     }
@@ -482,8 +4047,15 @@ namespace hsa {
       }
       ref_count_--;
       if (ref_count_ == 0) {
+        // deleting an agent joins its packet processor and worker threads
+        for (size_t i = 0; i < agents_.get()->size(); i++) {
+          delete agents_.get()->at(i);
+        }
         agents_.reset(nullptr);
-        // TODO: fix memory leak here
+        for (size_t i = 0; i < caches_.get()->size(); i++) {
+          delete caches_.get()->at(i);
+        }
+        caches_.reset(nullptr);
       }
       return HSA_STATUS_SUCCESS;
     }
@@ -493,6 +4065,10 @@ namespace hsa {
     std::mutex mutex_;
     int32_t ref_count_;
     std::unique_ptr<std::vector<HostAgent*>> agents_;
+    std::unique_ptr<std::vector<Region*>> regions_;
+    // every region created so far, in creation order
+    std::vector<Region*> all_regions_;
+    std::unique_ptr<std::vector<Cache*>> caches_;
   };
 
   static Runtime runtime_g;
@@ -541,15 +4117,14 @@ extern "C" {
 
   hsa_status_t hsa_signal_create(hsa_signal_value_t initial_value, uint32_t num_consumers, const hsa_agent_t *consumers, hsa_signal_t *signal) {
     // ignore consumers hint for now
-    hsa::Signal* sig = new hsa::Signal(initial_value);
-    signal->handle = (uint64_t) sig;
-    return HSA_STATUS_SUCCESS;
+    return hsa::signal_pool_g.Create(initial_value, signal);
   }
 
   hsa_status_t hsa_signal_destroy(hsa_signal_t signal) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
-    delete sig;
-    return HSA_STATUS_SUCCESS;
+    if (signal.handle == 0) {
+      return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    return hsa::signal_pool_g.Destroy(signal);
   }
 
   hsa_status_t hsa_queue_inactivate(hsa_queue_t *queue) {
@@ -558,156 +4133,205 @@ extern "C" {
   }
 
   hsa_signal_value_t hsa_signal_load_acquire(hsa_signal_t signal) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     return sig->Load(std::memory_order_acquire);
   }
 
   hsa_signal_value_t hsa_signal_load_relaxed(hsa_signal_t signal) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     return sig->Load(std::memory_order_relaxed);
   }
 
   void hsa_signal_store_relaxed(hsa_signal_t signal, hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     sig->Store(value, std::memory_order_relaxed);
   }
 
   void hsa_signal_store_release(hsa_signal_t signal, hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     sig->Store(value, std::memory_order_release);
   }
 
   hsa_signal_value_t hsa_signal_exchange_acq_rel(hsa_signal_t signal, hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     return sig->Exchange(value, std::memory_order_acq_rel);
   }
 
   hsa_signal_value_t hsa_signal_exchange_acquire(hsa_signal_t signal, hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     return sig->Exchange(value, std::memory_order_acquire);
   }
 
   hsa_signal_value_t hsa_signal_exchange_relaxed(hsa_signal_t signal, hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     return sig->Exchange(value, std::memory_order_relaxed);
   }
 
   hsa_signal_value_t hsa_signal_exchange_release(hsa_signal_t signal, hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     return sig->Exchange(value, std::memory_order_release);
   }
 
   hsa_signal_value_t hsa_signal_cas_acq_rel(hsa_signal_t signal, hsa_signal_value_t expected,
     hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     return sig->Cas(expected, value, std::memory_order_acq_rel);
   }
 
   hsa_signal_value_t HSA_API hsa_signal_cas_acquire(hsa_signal_t signal, hsa_signal_value_t expected,
     hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     return sig->Cas(expected, value, std::memory_order_acquire);
   }
 
   hsa_signal_value_t HSA_API hsa_signal_cas_relaxed(hsa_signal_t signal, hsa_signal_value_t expected,
     hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     return sig->Cas(expected, value, std::memory_order_relaxed);
   }
 
   hsa_signal_value_t HSA_API hsa_signal_cas_release(hsa_signal_t signal, hsa_signal_value_t expected, hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     return sig->Cas(expected, value, std::memory_order_release);
   }
 
   void hsa_signal_add_acq_rel(hsa_signal_t signal, hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     sig->Add(value, std::memory_order_acq_rel);
   }
 
   void hsa_signal_add_acquire(hsa_signal_t signal, hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     sig->Add(value, std::memory_order_acquire);
   }
 
   void hsa_signal_add_relaxed(hsa_signal_t signal, hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     sig->Add(value, std::memory_order_relaxed);
   }
 
   void hsa_signal_add_release(hsa_signal_t signal, hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     sig->Add(value, std::memory_order_release);
   }
 
   void hsa_signal_subtract_acq_rel(hsa_signal_t signal, hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     sig->Subtract(value, std::memory_order_acq_rel);
   }
 
   void hsa_signal_subtract_acquire(hsa_signal_t signal, hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     sig->Subtract(value, std::memory_order_acquire);
   }
 
   void hsa_signal_subtract_relaxed(hsa_signal_t signal, hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     sig->Subtract(value, std::memory_order_relaxed);
   }
 
   void hsa_signal_subtract_release(hsa_signal_t signal, hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     sig->Subtract(value, std::memory_order_release);
   }
 
   void hsa_signal_or_acq_rel(hsa_signal_t signal, hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     sig->Or(value, std::memory_order_acq_rel);
   }
 
   void hsa_signal_or_acquire(hsa_signal_t signal, hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     sig->Or(value, std::memory_order_acquire);
   }
 
   void hsa_signal_or_relaxed(hsa_signal_t signal, hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     sig->Or(value, std::memory_order_relaxed);
   }
 
   void hsa_signal_or_release(hsa_signal_t signal, hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     sig->Or(value, std::memory_order_release);
   }
 
   void hsa_signal_xor_acq_rel(hsa_signal_t signal, hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     sig->Xor(value, std::memory_order_acq_rel);
   }
 
   void hsa_signal_xor_acquire(hsa_signal_t signal, hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     sig->Xor(value, std::memory_order_acquire);
   }
 
   void hsa_signal_xor_relaxed(hsa_signal_t signal, hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     sig->Xor(value, std::memory_order_relaxed);
   }
 
   void hsa_signal_xor_release(hsa_signal_t signal, hsa_signal_value_t value) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
+    hsa::Signal* sig = hsa::ToSignal(signal);
     sig->Xor(value, std::memory_order_release);
   }
 
   hsa_signal_value_t hsa_signal_wait_acquire(hsa_signal_t signal, hsa_signal_condition_t condition, hsa_signal_value_t compare_value, uint64_t timeout_hint, hsa_wait_state_t wait_expectancy_hint) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
-    return sig->Wait(std::memory_order_acquire, condition, compare_value);
+    hsa::Signal* sig = hsa::ToSignal(signal);
+    return sig->Wait(std::memory_order_acquire, condition, compare_value, hsa::timestamp_g.ToNs(timeout_hint), wait_expectancy_hint);
   }
 
   hsa_signal_value_t hsa_signal_wait_relaxed(hsa_signal_t signal, hsa_signal_condition_t condition, hsa_signal_value_t compare_value, uint64_t timeout_hint, hsa_wait_state_t wait_expectancy_hint) {
-    hsa::Signal* sig = (hsa::Signal*) signal.handle;
-    return sig->Wait(std::memory_order_relaxed, condition, compare_value);
+    hsa::Signal* sig = hsa::ToSignal(signal);
+    return sig->Wait(std::memory_order_relaxed, condition, compare_value, hsa::timestamp_g.ToNs(timeout_hint), wait_expectancy_hint);
+  }
+
+  hsa_status_t hsa_signal_group_create(uint32_t num_signals, const hsa_signal_t *signals, uint32_t num_consumers,
+    const hsa_agent_t *consumers, hsa_signal_group_t *signal_group) {
+    if (num_signals == 0 || signals == NULL || num_consumers == 0 || consumers == NULL || signal_group == NULL) {
+      return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    for (uint32_t i = 0; i < num_signals; i++) {
+      if (hsa::signal_pool_g.Lookup(signals[i].handle) == nullptr) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+      }
+    }
+    // ignore consumers hint for now
+    hsa::SignalGroup* group = new hsa::SignalGroup(num_signals, signals);
+    signal_group->handle = (uint64_t) group;
+    return HSA_STATUS_SUCCESS;
+  }
+
+  hsa_status_t hsa_signal_group_destroy(hsa_signal_group_t signal_group) {
+    if (signal_group.handle == 0) {
+      return HSA_STATUS_ERROR_INVALID_SIGNAL_GROUP;
+    }
+    hsa::SignalGroup* group = (hsa::SignalGroup*) signal_group.handle;
+    delete group;
+    return HSA_STATUS_SUCCESS;
+  }
+
+  hsa_status_t hsa_signal_group_wait_any_scacquire(hsa_signal_group_t signal_group, const hsa_signal_condition_t *conditions,
+    const hsa_signal_value_t *compare_values, hsa_wait_state_t wait_state_hint, hsa_signal_t *signal, hsa_signal_value_t *value) {
+    if (signal_group.handle == 0) {
+      return HSA_STATUS_ERROR_INVALID_SIGNAL_GROUP;
+    }
+    if (conditions == NULL || compare_values == NULL || signal == NULL || value == NULL) {
+      return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    hsa::SignalGroup* group = (hsa::SignalGroup*) signal_group.handle;
+    return group->WaitAny(std::memory_order_acquire, conditions, compare_values, wait_state_hint, signal, value);
+  }
+
+  hsa_status_t hsa_signal_group_wait_any_relaxed(hsa_signal_group_t signal_group, const hsa_signal_condition_t *conditions,
+    const hsa_signal_value_t *compare_values, hsa_wait_state_t wait_state_hint, hsa_signal_t *signal, hsa_signal_value_t *value) {
+    if (signal_group.handle == 0) {
+      return HSA_STATUS_ERROR_INVALID_SIGNAL_GROUP;
+    }
+    if (conditions == NULL || compare_values == NULL || signal == NULL || value == NULL) {
+      return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    hsa::SignalGroup* group = (hsa::SignalGroup*) signal_group.handle;
+    return group->WaitAny(std::memory_order_relaxed, conditions, compare_values, wait_state_hint, signal, value);
   }
 
   hsa_status_t hsa_queue_create(
@@ -720,6 +4344,10 @@ extern "C" {
     uint32_t group_segment_size,
     hsa_queue_t **queue) {
     hsa::Queue* q = new hsa::Queue(agent, size, type, callback, data);
+    if (!q->AgentDispatchQueue() && !q->Start()) {
+      delete q;
+      return HSA_STATUS_ERROR_OUT_OF_RESOURCES;
+    }
     *queue = (hsa_queue_t*)q;
     return HSA_STATUS_SUCCESS;
   }
@@ -800,6 +4428,50 @@ extern "C" {
     return q->AddWriteIndex(value, std::memory_order_relaxed);
   }
 
+  // Extensions of the CPU runtime, declared in hsa_cpu.h
+
+  hsa_status_t hsa_cpu_queue_kernarg_allocate(const hsa_queue_t *queue, uint64_t packet_id, size_t size, void** ptr) {
+    hsa::Queue* q = (hsa::Queue*) queue;
+    if (ptr == nullptr) {
+      return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    return q->AllocKernarg(packet_id, size, ptr);
+  }
+
+  hsa_status_t hsa_cpu_queue_set_profiling(hsa_queue_t *queue, int enable) {
+    hsa::Queue* q = (hsa::Queue*) queue;
+    if (q == nullptr || q->AgentDispatchQueue()) {
+      return HSA_STATUS_ERROR_INVALID_QUEUE;
+    }
+    q->SetProfiling(enable != 0);
+    return HSA_STATUS_SUCCESS;
+  }
+
+  hsa_status_t hsa_cpu_queue_get_dispatch_time(const hsa_queue_t *queue, uint64_t packet_id, hsa_cpu_dispatch_time_t* time) {
+    hsa::Queue* q = (hsa::Queue*) queue;
+    if (q == nullptr) {
+      return HSA_STATUS_ERROR_INVALID_QUEUE;
+    }
+    if (time == nullptr || !q->GetTimes(packet_id, time)) {
+      return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    return HSA_STATUS_SUCCESS;
+  }
+
+  hsa_status_t hsa_cpu_queue_get_signal_dispatch_time(const hsa_queue_t *queue, hsa_signal_t signal, hsa_cpu_dispatch_time_t* time) {
+    hsa::Queue* q = (hsa::Queue*) queue;
+    if (q == nullptr) {
+      return HSA_STATUS_ERROR_INVALID_QUEUE;
+    }
+    if (signal.handle == 0) {
+      return HSA_STATUS_ERROR_INVALID_SIGNAL;
+    }
+    if (time == nullptr || !q->GetTimes(signal, time)) {
+      return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    return HSA_STATUS_SUCCESS;
+  }
+
   void hsa_queue_store_read_index_relaxed(const hsa_queue_t *queue, uint64_t value) {
     hsa::Queue* q = (hsa::Queue*) queue;
     q->StoreReadIndex(value, std::memory_order_relaxed);
@@ -826,26 +4498,208 @@ extern "C" {
     return a->IterateRegions(callback, data);
   }
 
+  hsa_status_t hsa_cache_get_info(hsa_cache_t cache, hsa_cache_info_t attribute, void* value) {
+    hsa::Cache* c = (hsa::Cache*) cache.handle;
+    if (c == nullptr) {
+      return HSA_STATUS_ERROR_INVALID_CACHE;
+    }
+    if (value == nullptr) {
+      return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    return c->Get(attribute, value);
+  }
+
+  hsa_status_t hsa_agent_iterate_caches(
+    hsa_agent_t agent,
+    hsa_status_t(*callback)(hsa_cache_t cache, void* data),
+    void* data) {
+    hsa::Agent* a = (hsa::Agent*) agent.handle;
+    if (a == nullptr) {
+      return HSA_STATUS_ERROR_INVALID_AGENT;
+    }
+    if (callback == nullptr) {
+      return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    return a->IterateCaches(callback, data);
+  }
+
+  hsa_status_t hsa_isa_from_name(const char* name, hsa_isa_t* isa) {
+    if (name == nullptr || isa == nullptr) {
+      return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    const hsa::Isa* i = hsa::FindIsa(name);
+    if (i == nullptr) {
+      return HSA_STATUS_ERROR_INVALID_ISA_NAME;
+    }
+    isa->handle = (uint64_t)i;
+    return HSA_STATUS_SUCCESS;
+  }
+
+  hsa_status_t hsa_agent_iterate_isas(
+    hsa_agent_t agent,
+    hsa_status_t(*callback)(hsa_isa_t isa, void* data),
+    void* data) {
+    hsa::Agent* a = (hsa::Agent*) agent.handle;
+    if (a == nullptr) {
+      return HSA_STATUS_ERROR_INVALID_AGENT;
+    }
+    if (callback == nullptr) {
+      return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    return a->IterateIsas(callback, data);
+  }
+
+  hsa_status_t hsa_isa_get_info(hsa_isa_t isa, hsa_isa_info_t attribute, uint32_t index, void* value) {
+    const hsa::Isa* i = (const hsa::Isa*) isa.handle;
+    if (i == nullptr) {
+      return HSA_STATUS_ERROR_INVALID_ISA;
+    }
+    if (value == nullptr) {
+      return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    // only the call convention attributes are indexed, and there is a single call convention
+    bool indexed = attribute == HSA_ISA_INFO_CALL_CONVENTION_INFO_WAVEFRONT_SIZE ||
+      attribute == HSA_ISA_INFO_CALL_CONVENTION_INFO_WAVEFRONTS_PER_COMPUTE_UNIT;
+    if (indexed && index != 0) {
+      return HSA_STATUS_ERROR_INVALID_INDEX;
+    }
+    return i->Get(attribute, value);
+  }
+
+  hsa_status_t hsa_isa_get_info_alt(hsa_isa_t isa, hsa_isa_info_t attribute, void* value) {
+    const hsa::Isa* i = (const hsa::Isa*) isa.handle;
+    if (i == nullptr) {
+      return HSA_STATUS_ERROR_INVALID_ISA;
+    }
+    if (value == nullptr) {
+      return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    return i->Get(attribute, value);
+  }
+
+  hsa_status_t hsa_isa_iterate_wavefronts(
+    hsa_isa_t isa,
+    hsa_status_t(*callback)(hsa_wavefront_t wavefront, void* data),
+    void* data) {
+    const hsa::Isa* i = (const hsa::Isa*) isa.handle;
+    if (i == nullptr) {
+      return HSA_STATUS_ERROR_INVALID_ISA;
+    }
+    if (callback == nullptr) {
+      return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    hsa_wavefront_t w;
+    w.handle = (uint64_t)i->GetWavefront();
+    return callback(w, data);
+  }
+
+  hsa_status_t hsa_wavefront_get_info(hsa_wavefront_t wavefront, hsa_wavefront_info_t attribute, void* value) {
+    const hsa::Wavefront* w = (const hsa::Wavefront*) wavefront.handle;
+    if (w == nullptr) {
+      return HSA_STATUS_ERROR_INVALID_WAVEFRONT;
+    }
+    if (value == nullptr) {
+      return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    return w->Get(attribute, value);
+  }
+
   hsa_status_t hsa_memory_allocate(hsa_region_t region, size_t size, void** ptr) {
+    if (ptr == nullptr || size == 0) {
+      return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
     hsa::Region* r = (hsa::Region*) region.handle;
-    *ptr = r->Alloc(size);
+    if (r == nullptr) {
+      return HSA_STATUS_ERROR_INVALID_REGION;
+    }
+    void* block = r->Alloc(size);
+    if (block == nullptr) {
+      return HSA_STATUS_ERROR_OUT_OF_RESOURCES;
+    }
+    if (!hsa::allocation_index_g.Insert(block, r)) {
+      r->Free(block);
+      return HSA_STATUS_ERROR_OUT_OF_RESOURCES;
+    }
+    *ptr = block;
     return HSA_STATUS_SUCCESS;
   }
 
   hsa_status_t hsa_memory_free(void* ptr) {
-    // TODO: given a ptr, find the corresponding region
-    // empty for now
+    if (ptr == nullptr) {
+      return HSA_STATUS_SUCCESS;
+    }
+    // the block is removed from the index before it is freed, since the allocator might hand
+    // out the same address again right away
+    hsa::Region* r = hsa::allocation_index_g.Remove(ptr);
+    if (r == nullptr) {
+      // not returned by hsa_memory_allocate, or freed already
+      return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    r->Free(ptr);
     return HSA_STATUS_SUCCESS;
   }
 
-  hsa_status_t hsa_memory_register(void *address, size_t size) {
+  hsa_status_t hsa_memory_copy(void* dst, const void* src, size_t size) {
+    if (dst == nullptr || src == nullptr) {
+      return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    hsa::copy_engine_g.Copy(dst, src, size);
     return HSA_STATUS_SUCCESS;
   }
 
-  hsa_status_t hsa_memory_deregister(void *address, size_t size) {
+  // Extension of the CPU runtime, declared in hsa_cpu.h
+  hsa_status_t hsa_cpu_memory_async_copy(void* dst, const void* src, size_t size, uint32_t num_dep_signals,
+    const hsa_signal_t* dep_signals, hsa_signal_t completion_signal) {
+    if (dst == nullptr || src == nullptr || (num_dep_signals != 0 && dep_signals == nullptr)) {
+      return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    for (uint32_t i = 0; i < num_dep_signals; i++) {
+      if (hsa::signal_pool_g.Lookup(dep_signals[i].handle) == nullptr) {
+        return HSA_STATUS_ERROR_INVALID_SIGNAL;
+      }
+    }
+    if (completion_signal.handle != 0 && hsa::signal_pool_g.Lookup(completion_signal.handle) == nullptr) {
+      return HSA_STATUS_ERROR_INVALID_SIGNAL;
+    }
+    hsa::async_copy_engine_g.Submit(dst, src, size, num_dep_signals, dep_signals, completion_signal);
     return HSA_STATUS_SUCCESS;
   }
 
+  hsa_status_t hsa_memory_assign_agent(void* ptr, hsa_agent_t agent, hsa_access_permission_t access) {
+    if (ptr == nullptr || access < HSA_ACCESS_PERMISSION_RO || access > HSA_ACCESS_PERMISSION_RW) {
+      return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    if (agent.handle == 0) {
+      return HSA_STATUS_ERROR_INVALID_AGENT;
+    }
+    hsa::Region* r = hsa::allocation_index_g.Lookup(ptr);
+    if (r == nullptr) {
+      return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    return r->AssignAgent(ptr, agent, access);
+  }
+
+  hsa_status_t hsa_memory_register(void *address, size_t size) {
+    if (address == nullptr) {
+      return HSA_STATUS_SUCCESS;
+    }
+    if (size == 0) {
+      return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    // memory of the HSA allocator needs no registration
+    if (hsa::allocation_index_g.Lookup(address) != nullptr) {
+      return HSA_STATUS_SUCCESS;
+    }
+    return hsa::registration_cache_g.Register(address, size);
+  }
+
+  hsa_status_t hsa_memory_deregister(void *address, size_t size) {
+    if (address == nullptr || size == 0 || hsa::allocation_index_g.Lookup(address) != nullptr) {
+      return HSA_STATUS_SUCCESS;
+    }
+    return hsa::registration_cache_g.Deregister(address, size);
+  }
+
 #ifdef __cplusplus
 }
 #endif
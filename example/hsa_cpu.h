@@ -0,0 +1,119 @@
+#ifndef HSA_RUNTIME_EXAMPLE_HSA_CPU_H_
+#define HSA_RUNTIME_EXAMPLE_HSA_CPU_H_
+
+#include "hsa.h"
+
+/*
+ * Extensions of the CPU runtime (hsa.cc), not part of the HSA API. Attributes
+ * use values above the range of the corresponding HSA enumeration.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif  /* __cplusplus */
+
+/**
+ * @brief Physical cores of a CPU agent. The type of this attribute is uint32_t.
+ */
+#define HSA_CPU_AGENT_INFO_COMPUTE_UNIT_COUNT ((hsa_agent_info_t) 0x40000000)
+
+/**
+ * @brief Hardware threads of a CPU agent, counting every SMT sibling. The type
+ * of this attribute is uint32_t.
+ */
+#define HSA_CPU_AGENT_INFO_CPU_COUNT ((hsa_agent_info_t) 0x40000001)
+
+/**
+ * @brief Line size of a cache, in bytes. The type of this attribute is
+ * uint32_t.
+ */
+#define HSA_CPU_CACHE_INFO_LINE_SIZE ((hsa_cache_info_t) 0x40000000)
+
+/**
+ * @brief Work assigned to one kernel invocation: the workgroup id and the
+ * absolute range of work-items [begin, end) it covers in each dimension.
+ */
+typedef struct hsa_cpu_workgroup_s {
+  uint32_t id[3];
+  uint32_t begin[3];
+  uint32_t end[3];
+} hsa_cpu_workgroup_t;
+
+/**
+ * @brief Signature of every kernel object. The kernel object is invoked once
+ * per workgroup with the kernarg address of the packet, including kernels that
+ * do not care about their position in the grid.
+ */
+typedef void (*hsa_cpu_kernel_t)(void* kernarg, const hsa_cpu_workgroup_t* workgroup);
+
+/**
+ * @brief Times of a packet in timestamp ticks, as recorded by the packet
+ * processor of a queue with profiling enabled: when the doorbell announced the
+ * packet, when its first workgroup started (or, for a barrier, when the
+ * processor first examined it) and when its completion signal was decremented.
+ */
+typedef struct hsa_cpu_dispatch_time_s {
+  uint64_t ready;
+  uint64_t start;
+  uint64_t end;
+} hsa_cpu_dispatch_time_t;
+
+/**
+ * @brief Allocate @p size bytes of kernarg memory for the packet with the given
+ * ID from the kernarg arena of the queue. The memory is reclaimed once the
+ * packet processor retires the packet, so it must not be freed. Waits while the
+ * arena is full, so producers must submit the packets they allocated kernargs
+ * for.
+ */
+hsa_status_t HSA_API hsa_cpu_queue_kernarg_allocate(
+    const hsa_queue_t *queue,
+    uint64_t packet_id,
+    size_t size,
+    void** ptr);
+
+/**
+ * @brief Start (@p enable != 0) or stop recording the times of the packets the
+ * packet processor of a kernel dispatch queue retires. Disabled by default.
+ */
+hsa_status_t HSA_API hsa_cpu_queue_set_profiling(
+    hsa_queue_t *queue,
+    int enable);
+
+/**
+ * @brief Times of the packet with the given ID, once it completed. Returns
+ * ::HSA_STATUS_ERROR_INVALID_ARGUMENT if the packet was not recorded, or its
+ * record was reused by the packet that took its slot a lap of the ring later.
+ */
+hsa_status_t HSA_API hsa_cpu_queue_get_dispatch_time(
+    const hsa_queue_t *queue,
+    uint64_t packet_id,
+    hsa_cpu_dispatch_time_t* time);
+
+/**
+ * @brief Times of the most recent packet of the queue that completed with the
+ * given completion signal.
+ */
+hsa_status_t HSA_API hsa_cpu_queue_get_signal_dispatch_time(
+    const hsa_queue_t *queue,
+    hsa_signal_t signal,
+    hsa_cpu_dispatch_time_t* time);
+
+/**
+ * @brief Copy @p size bytes from @p src to @p dst in the background, once all
+ * the dependency signals are 0. The completion signal (if its handle is not 0)
+ * is decremented when the copy is done; until then neither buffer may be
+ * modified or freed.
+ */
+hsa_status_t HSA_API hsa_cpu_memory_async_copy(
+    void* dst,
+    const void* src,
+    size_t size,
+    uint32_t num_dep_signals,
+    const hsa_signal_t* dep_signals,
+    hsa_signal_t completion_signal);
+
+#ifdef __cplusplus
+}  /* end extern "C" block */
+#endif  /* __cplusplus */
+
+#endif  /* HSA_RUNTIME_EXAMPLE_HSA_CPU_H_ */